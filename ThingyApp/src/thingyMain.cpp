@@ -21,7 +21,6 @@ int main(int argc,char *argv[])
         iocsh(argv[1]);
         epicsThreadSleep(.2);
     }
-    g_ioc_started = 1;
     //scanPVs();
     iocsh(NULL);
     disconnect();
@@ -29,15 +28,24 @@ int main(int argc,char *argv[])
     return(0);
 }
 
-void thingyConfig(char *mac) {
-	strncpy(g_mac_address, mac, strlen(mac));
+// adds an aggregator each call; its records use AggID 0 for the first call, 1 for the next...
+// nodes is the size of its node table; 0 for MAX_NODES
+void thingyConfig(char *mac, int nodes) {
+	if (mac == NULL) {
+		printf("Usage: thingyConfig <address> [nodes]\n");
+		return;
+	}
+	int agg_id = aggregator_create(mac, nodes > 0 ? nodes : MAX_NODES);
+	if (agg_id >= 0)
+		printf("Aggregator %s has AggID %d\n", mac, agg_id);
 }
 
 static const iocshArg thingyConfigArg0 = {"MAC address", iocshArgString};
-static const iocshArg * const thingyConfigArgs[] = {&thingyConfigArg0};
-static const iocshFuncDef configthingy = {"thingyConfig", 1, thingyConfigArgs};
+static const iocshArg thingyConfigArg1 = {"node count", iocshArgInt};
+static const iocshArg * const thingyConfigArgs[] = {&thingyConfigArg0, &thingyConfigArg1};
+static const iocshFuncDef configthingy = {"thingyConfig", 2, thingyConfigArgs};
 static void configthingyCallFunc(const iocshArgBuf *args) {
-	thingyConfig(args[0].sval);
+	thingyConfig(args[0].sval, args[1].ival);
 }
 
 static void thingyRegister(void) {
@@ -8,6 +8,8 @@
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
+#include <unistd.h>
+#include <stdatomic.h>
 
 #include <dbAccess.h>
 #include <dbDefs.h>
@@ -20,249 +22,478 @@
 #include <epicsExport.h>
 #include <epicsTime.h>
 #include <callback.h>
-
-#include <glib.h>
-#include "gattlib.h"
+#include <initHooks.h>
 
 #include "thingy_shared.h"
 #include "thingy_aggregator.h"
 #include "thingy_helpers.h"
-
-// lock for PV linked list
-static pthread_mutex_t g_pv_lock = PTHREAD_MUTEX_INITIALIZER;
-// lock for connection object
-static pthread_mutex_t g_connlock = PTHREAD_MUTEX_INITIALIZER;
-
-// flag to stop revive thread before cleanup
-static int g_stop;
-// flag for determining whether first-time setup has occured
-static int g_setup = 0;
-// LED toggle for all nodes
-static int g_led_all;
-// bitmap for toggling individual LEDs
-static int g_led_nodes[MAX_NODES];
-// bitmap for active nodes
-static int g_active[MAX_NODES];
+#include "thingy_ring.h"
+#include "thingy_commands.h"
+#include "thingy_stats.h"
+#include "thingy_capture.h"
+#include "thingy_node_ids.h"
+#include "thingy_filter.h"
 
 // thread functions
-static void	notification_listener();
-static void notif_callback(const uuid_t*, const uint8_t*, size_t, void*);
-static void	watchdog();
-static void	reconnect();
-
-static void disconnect_handler() {
-	printf("WARNING: Connection to aggregator lost.\n");
-	set_status(AGGREGATOR_ID, "DISCONNECTED");
-	#ifdef USE_CUSTOM_IDS
-		for (int i=0; i<MAX_NODES; i++) {
-			g_custom_node_ids[i] = -1;
-		}
-	#endif
-	g_broken_conn = 1;
+static void* notification_listener(void*);
+static int notif_callback(void*, const uint8_t*, size_t);
+static void* parser_worker(void*);
+static void* watchdog(void*);
+static void* reconnect(void*);
+
+// move connection state machine to new state and wake anyone waiting on it
+static void set_conn_state(Aggregator *agg, int state) {
+	pthread_mutex_lock(&agg->statelock);
+	agg->conn_state = state;
+	pthread_cond_broadcast(&agg->statecond);
+	pthread_mutex_unlock(&agg->statelock);
+	set_pv(get_pv(agg, AGGREGATOR_ID, ID_CONN_STATE), state);
+}
+
+static void disconnect_handler(void *user) {
+	Aggregator *agg = user;
+	printf("WARNING: Connection to aggregator %d lost.\n", agg->id);
+	set_status(agg, AGGREGATOR_ID, "DISCONNECTED");
+	// custom node IDs are kept; nodes stay connected to the aggregator and do not announce themselves again
+	agg->connected = 0;
+	agg->broken_conn = 1;
+	set_conn_state(agg, CONN_DISCONNECTED);
 }
 
-// connect, initialize global UUIDs for communication, start threads for monitoring connection
-static gatt_connection_t* get_connection() {
-	if (gp_connection != 0) {
-		return gp_connection;
+// single attempt to connect to aggregator and start notifications
+// returns 1 if connected
+static int connect_aggregator(Aggregator *agg) {
+	pthread_mutex_lock(&agg->connlock);
+	if (agg->connected) {
+		pthread_mutex_unlock(&agg->connlock);
+		return 1;
 	}
+	ThingyTransport *transport = agg->transport;
+	printf("Connecting to device %s (%s)...\n", agg->address, transport->name);
+	set_conn_state(agg, CONN_CONNECTING);
+	// release whatever is left of a dropped link before replacing it
+	if (agg->broken_conn)
+		transport->disconnect(transport);
+	// disconnect handler must be armed before the link can drop
+	transport->on_disconnect(transport, disconnect_handler, agg);
+	if (transport->connect(transport, agg->address) != 0) {
+		set_conn_state(agg, CONN_DISCONNECTED);
+		pthread_mutex_unlock(&agg->connlock);
+		return 0;
+	}
+	// notifications do not survive a dropped link, so subscribe on every connect
+	set_conn_state(agg, CONN_SUBSCRIBING);
+	if (transport->subscribe(transport, notif_callback, agg) != 0) {
+		printf("Failed to start notifications.\n");
+		transport->disconnect(transport);
+		set_conn_state(agg, CONN_DISCONNECTED);
+		pthread_mutex_unlock(&agg->connlock);
+		return 0;
+	}
+	agg->broken_conn = 0;
+	agg->connected = 1;
+	set_conn_state(agg, CONN_CONNECTED);
+	set_status(agg, AGGREGATOR_ID, "CONNECTED");
+	printf("Connected.\n");
+	pthread_mutex_unlock(&agg->connlock);
+	return 1;
+}
 
-	pthread_mutex_lock(&g_connlock);
-	// connection was made while thread waited for lock
-	if (gp_connection != 0)
-		return gp_connection;
-	printf("Connecting to device %s...\n", g_mac_address);
-	gp_connection = gattlib_connect(NULL, g_mac_address, GATTLIB_CONNECTION_OPTIONS_LEGACY_BDADDR_LE_PUBLIC | GATTLIB_CONNECTION_OPTIONS_LEGACY_BT_SEC_LOW);
-	if (gp_connection != 0) {
-		set_status(AGGREGATOR_ID, "CONNECTED");
-		printf("Connected.\n");
+// start threads for monitoring connection to aggregator
+// the reconnect thread makes the first connection once the IOC is running, so iocInit never waits on the link
+static void start_aggregator(Aggregator *agg) {
+	if (agg->setup)
+		return;
+	agg->transport = transport_for_address(agg->address);
+	if (agg->transport == 0) {
+		printf("Failed to create transport for %s\n", agg->address);
+		exit(1);
 	}
-	g_recv_uuid = aggregator_UUID(UUID_RECV);
-	g_send_uuid = aggregator_UUID(UUID_SEND);
+	// route data from nodes that connected before the IOC started
+	node_ids_load(agg);
 	// register cleanup method
 	signal(SIGINT, disconnect);
 
 	// first-time setup
-	if (g_setup == 0) {
-		// create disconnect handler
-		gattlib_register_on_disconnect(gp_connection, disconnect_handler, NULL);
-		// start notification listener thread
-		printf("Starting notification listener thread...\n");
-		pthread_t listener;
-		pthread_create(&listener, NULL, &notification_listener, NULL);
-		// start watchdog thread
-		printf("Starting watchdog thread...\n");
-		pthread_t watchdog_pid;
-		pthread_create(&watchdog_pid, NULL, &watchdog, NULL);
-		// start reconnect thread
-		printf("Starting reconnection thread...\n");
-		pthread_t necromancer;
-		pthread_create(&necromancer, NULL, &reconnect, NULL);
-		#ifdef USE_CUSTOM_IDS
-			// initialize custom ID list as empty
-			for (int i=0; i<MAX_NODES; i++)
-				g_custom_node_ids[i] = -1;
-		#endif
-		g_setup = 1;
+	// start parser thread before notifications can arrive
+	printf("Starting parser thread...\n");
+	ring_init(&agg->ring);
+	pthread_t parser;
+	pthread_create(&parser, NULL, &parser_worker, agg);
+	// start command writer thread
+	printf("Starting command writer thread...\n");
+	command_queue_start(agg);
+	// start notification listener thread
+	printf("Starting notification listener thread...\n");
+	pthread_t listener;
+	pthread_create(&listener, NULL, &notification_listener, agg);
+	// start watchdog thread
+	printf("Starting watchdog thread...\n");
+	pthread_t watchdog_pid;
+	pthread_create(&watchdog_pid, NULL, &watchdog, agg);
+	// start reconnect thread
+	printf("Starting reconnection thread...\n");
+	pthread_t necromancer;
+	pthread_create(&necromancer, NULL, &reconnect, agg);
+	agg->setup = 1;
+}
+
+// runs at the end of iocInit; lets PVs be scanned and wakes reconnect threads to connect
+static void startup_hook(initHookState state) {
+	if (state != initHookAfterIocRunning)
+		return;
+	g_ioc_started = 1;
+	for (int i=0; i<g_num_aggregators; i++) {
+		Aggregator *agg = gp_aggregators[i];
+		pthread_mutex_lock(&agg->statelock);
+		pthread_cond_broadcast(&agg->statecond);
+		pthread_mutex_unlock(&agg->statelock);
 	}
-	pthread_mutex_unlock(&g_connlock);
-	return gp_connection;
 }
 
 
-// disconnect & cleanup
+// disconnect & cleanup every aggregator
 void disconnect() {
-	printf("Stopping reconnect thread...\n");
-	g_stop = 1;
-	while (g_stop != 0)
-		sleep(1);
-	PVnode *node = g_first_pv; 
-	PVnode *next;
-	printf("Stopping notifications...\n");
-	gattlib_notification_stop(gp_connection, &g_recv_uuid);
-	printf("Done.\n");
-	printf("Disconnecting from device...\n");
-	gattlib_disconnect(gp_connection);
-	printf("Done.\n");
+	for (int i=0; i<g_num_aggregators; i++) {
+		Aggregator *agg = gp_aggregators[i];
+		if (!agg->setup)
+			continue;
+		printf("Stopping reconnect thread of aggregator %d...\n", agg->id);
+		agg->stop = 1;
+		while (agg->stop != 0)
+			sleep(1);
+		capture_stop(&agg->capture);
+		printf("Stopping notifications...\n");
+		agg->transport->stop(agg->transport);
+		printf("Done.\n");
+		printf("Disconnecting from device %s...\n", agg->address);
+		agg->connected = 0;
+		agg->transport->disconnect(agg->transport);
+		printf("Done.\n");
+	}
 	exit(1);
 }
 
+// max PVs scanned per second by the initial publish after iocInit; 0 scans them all at once
+int thingyStartupScanRate = 1000;
+epicsExportAddress(int, thingyStartupScanRate);
+
+// nanoseconds on monotonic clock
+static uint64_t monotonic_ns(const struct timespec *ts) {
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// silence (in ns) after which a node is considered lost
+static uint64_t liveness_timeout_ns(Aggregator *agg, int node_id) {
+	float timeout = get_writer_pv_value(agg, node_id, ID_LIVENESS_TIMEOUT);
+	if (timeout <= 0)
+		timeout = LIVENESS_TIMEOUT;
+	return (uint64_t)(timeout * 1e9);
+}
+
+// order of the initial publish: connection state first, then configuration, then readings
+static int publish_priority(int pv_id) {
+	if (pv_id == ID_CONNECTION || pv_id == ID_STATUS || pv_id == ID_CONN_STATE)
+		return 0;
+	if ((pv_id >= ID_TEMP_INTERVAL && pv_id <= ID_GAS_MODE) || (pv_id >= ID_STEP_INTERVAL && pv_id <= ID_EXT3) ||
+			(pv_id >= ID_QUATERNION_DECIMATION && pv_id <= ID_EULER_DECIMATION))
+		return 1;
+	return 2;
+}
+#define NUM_PUBLISH_PRIORITIES 3
+
+// scan every PV of aggregator once, in order of publish_priority()
+// scans are spread out to thingyStartupScanRate per second so they do not crowd out live data in the scanOnce queue
+static void initial_publish(Aggregator *agg) {
+	int rate = thingyStartupScanRate;
+	// scans are released in groups every 10 ms, or one at a time at low rates
+	int group = rate / 100 > 0 ? rate / 100 : 1;
+	uint64_t group_ns = rate > 0 ? (uint64_t)group * 1000000000ULL / rate : 0;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t next = monotonic_ns(&ts);
+	int scans = 0;
+	for (int priority=0; priority<NUM_PUBLISH_PRIORITIES; priority++) {
+		// row -1 is the aggregator itself
+		for (int row=-1; row<agg->max_nodes; row++) {
+			aSubRecord **pvs = (row < 0) ? agg->pvs : agg->nodes[row].pvs;
+			for (int pv_id=0; pv_id<NUM_PV_IDS; pv_id++) {
+				if (pvs[pv_id] == 0 || publish_priority(pv_id) != priority || pv_id == ID_INITIAL_PUBLISH)
+					continue;
+				if (row >= 0 && pv_id == ID_LIVENESS_TIMEOUT)
+					continue;
+				if (rate > 0 && scans > 0 && scans % group == 0) {
+					next += group_ns;
+					ts.tv_sec = next / 1000000000ULL;
+					ts.tv_nsec = next % 1000000000ULL;
+					clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+				}
+				scan_pv(pvs[pv_id], 0);
+				scans++;
+			}
+		}
+	}
+	printf("watchdog: Published %d PVs of aggregator %d\n", scans, agg->id);
+	set_pv(get_pv(agg, AGGREGATOR_ID, ID_INITIAL_PUBLISH), 1);
+}
+
 // thread function to check that active nodes are still connected
-static void watchdog() {
+// sleeps until the earliest time a node could exceed its liveness timeout
+static void* watchdog(void *arg) {
+	Aggregator *agg = arg;
 	// wait for IOC to start
 	while (g_ioc_started == 0)
 		sleep(1);
-	// scan all PVs in case any were set before IOC started
-	PVnode *node = g_first_pv;
-	while (node != 0) {
-		scanOnce(node->pv);
-		node = node->next;
+	// publish all PVs in case any were set before IOC started
+	initial_publish(agg);
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = monotonic_ns(&ts);
+	// nodes which have not been heard from yet get a full timeout from now
+	for (int i=0; i<agg->max_nodes; i++) {
+		if (atomic_load_explicit(&agg->nodes[i].last_seen, memory_order_relaxed) == 0)
+			atomic_store_explicit(&agg->nodes[i].last_seen, now, memory_order_relaxed);
 	}
 
-	uint8_t node_id;
-	uint8_t custom_id;
+	int node_id;
 	while(1) {
-		for (node_id=0; node_id<MAX_NODES; node_id++) {
-			// only check nodes that have PVs and are assigned a node ID
-			if (g_active[node_id]) {
-				#ifdef USE_CUSTOM_IDS
-					if (g_custom_node_ids[node_id] != -1) {
-				#endif
-				if (g_alive[node_id] == 0 && g_dead[node_id] == 0) {
-					#ifdef USE_CUSTOM_IDS
-						custom_id = g_custom_node_ids[node_id];
-						printf("watchdog: Lost connection to node %d\n", custom_id);
-					#else
-						printf("watchdog: Lost connection to node %d\n", node_id);
-					#endif
-					disconnect_node(node_id);
-					g_dead[node_id] = 1;
-					//printf("g_dead[%d] = 1\n", node_id);
-				}
-				else {
-					g_alive[node_id] = 0;
-				}
-				#ifdef USE_CUSTOM_IDS
-				}
-				#endif
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = monotonic_ns(&ts);
+		// wake at least once a second to pick up timeout changes
+		uint64_t next_deadline = now + 1000000000ULL;
+		for (node_id=0; node_id<agg->max_nodes; node_id++) {
+			NodeState *node = &agg->nodes[node_id];
+			// only check live nodes that have PVs and are assigned a node ID
+			if (!node->active || node->dead)
+				continue;
+			if (g_custom_ids && node->custom_id == -1)
+				continue;
+			uint64_t deadline = atomic_load_explicit(&node->last_seen, memory_order_relaxed) + liveness_timeout_ns(agg, node_id);
+			if (deadline <= now) {
+				printf("watchdog: Lost connection to node %d of aggregator %d\n", g_custom_ids ? node->custom_id : node_id, agg->id);
+				disconnect_node(agg, node_id);
+				node->dead = 1;
+			}
+			else if (deadline < next_deadline) {
+				next_deadline = deadline;
 			}
-		// sleep for HEARTBEAT_DELAY ms
-		usleep(HEARTBEAT_DELAY * 1000);
 		}
+		ts.tv_sec = next_deadline / 1000000000ULL;
+		ts.tv_nsec = next_deadline % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
 	}
+	return 0;
 }
 
-// thread function to attempt to reconnect to aggregator
-static void reconnect() {
-	while(g_ioc_started == 0)
-		sleep(1);
-	int i;
+// request current config from every active node
+// config PVs would otherwise keep values from before the link dropped
+static void reread_node_configs(Aggregator *agg) {
+	for (int node_id=0; node_id<agg->max_nodes; node_id++) {
+		if (!agg->nodes[node_id].active)
+			continue;
+		if (g_custom_ids && agg->nodes[node_id].custom_id == -1)
+			continue;
+		send_read_command(agg, COMMAND_ENV_CONFIG_READ, node_id);
+		send_read_command(agg, COMMAND_MOTION_CONFIG_READ, node_id);
+		send_read_command(agg, COMMAND_CONN_PARAM_READ, node_id);
+		send_read_command(agg, COMMAND_IO_READ, node_id);
+	}
+}
+
+// delay (in ms) before reconnect attempt; exponential in attempt with +/-50% jitter
+// jitter keeps multiple IOCs from retrying against the aggregator in lockstep
+static long backoff_delay(int attempt, unsigned int *seed) {
+	long delay = RECONNECT_MIN_DELAY;
+	for (int i=0; i<attempt && delay < RECONNECT_MAX_DELAY; i++)
+		delay *= 2;
+	if (delay > RECONNECT_MAX_DELAY)
+		delay = RECONNECT_MAX_DELAY;
+	return delay / 2 + rand_r(seed) % (delay + 1);
+}
+
+// thread function to run reconnection state machine
+// waits for the link to drop, then retries with backoff until subscribed again
+static void* reconnect(void *arg) {
+	Aggregator *agg = arg;
+	struct timespec lost, now;
+	// wait for startup_hook(); wake periodically to check for stop
+	pthread_mutex_lock(&agg->statelock);
+	while (!g_ioc_started && !agg->stop) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		now.tv_sec += 1;
+		pthread_cond_timedwait(&agg->statecond, &agg->statelock, &now);
+	}
+	pthread_mutex_unlock(&agg->statelock);
+	unsigned int seed = time(NULL) ^ getpid() ^ (agg->id << 16);
+	clock_gettime(CLOCK_MONOTONIC, &lost);
+	// first connection is attempted without delay; a failed one is retried with backoff below
+	if (!agg->stop) {
+		// config reads triggered by PINI records during iocInit were dropped while unconnected
+		if (connect_aggregator(agg))
+			reread_node_configs(agg);
+		else
+			agg->broken_conn = 1;
+	}
 	while(1) {
-		if (g_broken_conn) {
-			printf("reconnect: Attempting reconnection to aggregator...\n");
-			gp_connection = 0;
-			get_connection();
-			if (gp_connection != 0)
-				g_broken_conn = 0;
+		// wait for connection to drop; wake periodically to check for stop
+		pthread_mutex_lock(&agg->statelock);
+		while (!agg->broken_conn && !agg->stop) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			now.tv_sec += 1;
+			pthread_cond_timedwait(&agg->statecond, &agg->statelock, &now);
 		}
-		if (g_stop) {
-			printf("reconnect: Reconnect thread stopped.\n");
-			g_stop = 0;
-			return;
+		pthread_mutex_unlock(&agg->statelock);
+		if (agg->stop)
+			break;
+
+		if (agg->connected == 0)
+			clock_gettime(CLOCK_MONOTONIC, &lost);
+		for (int attempt=0; !agg->connected && !agg->stop; attempt++) {
+			long delay = backoff_delay(attempt, &seed);
+			printf("reconnect: Attempting reconnection to aggregator %d in %ld ms...\n", agg->id, delay);
+			set_conn_state(agg, CONN_BACKOFF);
+			usleep(delay * 1000);
+			if (agg->stop)
+				break;
+			connect_aggregator(agg);
 		}
-		sleep(RECONNECT_DELAY);
+		if (agg->stop)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double recovery = (now.tv_sec - lost.tv_sec) + (now.tv_nsec - lost.tv_nsec) / 1e9;
+		printf("reconnect: Reconnected to aggregator %d after %.2f s\n", agg->id, recovery);
+		set_pv(get_pv(agg, AGGREGATOR_ID, ID_RECOVERY_TIME), recovery);
+		reread_node_configs(agg);
 	}
+	printf("reconnect: Reconnect thread of aggregator %d stopped.\n", agg->id);
+	agg->stop = 0;
+	return 0;
 }
 
 // thread function to begin listening for UUID notifications from aggregator
-static void notification_listener() {
-	gattlib_register_notification(gp_connection, notif_callback, NULL);
-	gattlib_notification_start(gp_connection, &g_recv_uuid);
+static void* notification_listener(void *arg) {
+	Aggregator *agg = arg;
 	// run forever waiting for notifications
-	GMainLoop *loop = g_main_loop_new(NULL, 0);
-	g_main_loop_run(loop);
+	agg->transport->listen(agg->transport);
+	return 0;
+}
+
+// queue notification for parser thread
+// runs on the transport thread, so only records arrival and copies the payload
+static int notif_callback(void *user, const uint8_t *resp, size_t len) {
+	Aggregator *agg = user;
+	struct timespec now, recv_time;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	clock_gettime(CLOCK_REALTIME, &recv_time);
+	if (len > RESP_ID && resp[RESP_ID] < agg->max_nodes)
+		atomic_store_explicit(&agg->nodes[resp[RESP_ID]].last_seen, monotonic_ns(&now), memory_order_relaxed);
+	int node_id = (len > RESP_ID) ? resp[RESP_ID] : -1;
+	int opcode = (len > RESP_OPCODE) ? resp[RESP_OPCODE] : -1;
+	stats_add(&agg->stats, node_id, opcode, STAT_PACKETS, 1);
+	stats_add(&agg->stats, node_id, opcode, STAT_BYTES, len);
+	capture_notification(&agg->capture, resp, len, monotonic_ns(&now));
+	if (agg->transport->lossless) {
+		while (ring_depth(&agg->ring) >= RING_SIZE)
+			usleep(100);
+	}
+	return ring_push(&agg->ring, resp, len, &recv_time);
 }
 
 // parse notification and save to PV(s)
-static void notif_callback(const uuid_t *uuidObject, const uint8_t *resp, size_t len, void *user_data) {
+static void process_notification(Aggregator *agg, uint8_t *resp, size_t len, const struct timespec *recv_time) {
+	// records are stamped with the receive time rather than the time they are processed
+	epicsTimeStamp stamp;
+	epicsTimeFromTimespec(&stamp, recv_time);
+	// short responses are rejected and counted by parse_resp()
+	if (len <= RESP_ID || resp[RESP_ID] >= agg->max_nodes) {
+		parse_resp(agg, resp, len, &stamp);
+		return;
+	}
 	uint8_t node_id = resp[RESP_ID];
-	#ifdef USE_CUSTOM_IDS
-		uint8_t custom_id = g_custom_node_ids[node_id];
-	#endif
-
-	g_alive[node_id] = 1;
-	if (g_dead[node_id] == 1 && resp[RESP_OPCODE] != OPCODE_CONNECT) {
-		#ifdef USE_CUSTOM_IDS
-			printf("Node %d successfully reconnected.\n", custom_id);
-		#else
-			printf("Node %d successfully reconnected.\n", node_id);
-		#endif
-		set_status(node_id, "CONNECTED");
-		set_connection(node_id, CONNECTED);
-		g_dead[node_id] = 0;
+
+	if (agg->nodes[node_id].dead == 1 && resp[RESP_OPCODE] != OPCODE_CONNECT) {
+		printf("Node %d successfully reconnected.\n", g_custom_ids ? agg->nodes[node_id].custom_id : node_id);
+		set_status(agg, node_id, "CONNECTED");
+		set_connection(agg, node_id, CONNECTED);
+		agg->nodes[node_id].dead = 0;
 	}
 
-	parse_resp(resp, len);
+	parse_resp(agg, resp, len, &stamp);
+}
+
+// publish notification queue and publish latency statistics
+static void publish_queue_stats(Aggregator *agg) {
+	set_pv(get_pv(agg, AGGREGATOR_ID, ID_QUEUE_DEPTH), ring_depth(&agg->ring));
+	set_pv(get_pv(agg, AGGREGATOR_ID, ID_QUEUE_HIGH_WATER), ring_high_water(&agg->ring));
+	set_pv(get_pv(agg, AGGREGATOR_ID, ID_QUEUE_OVERFLOWS), ring_overflows(&agg->ring));
+	double latency[LATENCY_BUCKETS];
+	take_publish_latency(agg, latency);
+	set_pv_array(get_pv(agg, AGGREGATOR_ID, ID_PUBLISH_LATENCY), latency, LATENCY_BUCKETS);
+}
+
+// thread function to drain notification ring in batches
+static void* parser_worker(void *arg) {
+	Aggregator *agg = arg;
+	struct timespec now, last_stats;
+	clock_gettime(CLOCK_MONOTONIC, &last_stats);
+	while(1) {
+		ring_wait(&agg->ring, STATS_INTERVAL);
+		RingSlot *slot;
+		for (int i=0; i<RING_BATCH && (slot = ring_peek(&agg->ring)) != 0; i++) {
+			process_notification(agg, slot->data, slot->len, &slot->recv_time);
+			ring_pop(&agg->ring);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed_ms = (now.tv_sec - last_stats.tv_sec) * 1000 + (now.tv_nsec - last_stats.tv_nsec) / 1000000;
+		if (elapsed_ms >= STATS_INTERVAL && g_ioc_started) {
+			publish_queue_stats(agg);
+			stats_publish(agg, elapsed_ms);
+			last_stats = now;
+		}
+	}
+	return 0;
 }
 
 // PV startup function 
-// adds PV to global linked list
+// adds PV to PV table of its aggregator
 static long register_pv(aSubRecord *pv) {
-	// initialize globals
-	get_connection();
+	Aggregator *agg = pv_aggregator(pv);
+	if (agg == 0)
+		return 0;
+	// start threads of aggregator; connecting is left to them
+	start_aggregator(agg);
 	int node_id, pv_id;
 	memcpy(&node_id, pv->a, sizeof(int));
-	if (node_id > (MAX_NODES-1) && node_id != AGGREGATOR_ID) {
-		printf("MAX_NODES exceeded. Ignoring PVs for node %d\n", node_id);
-		return;
+	if (node_id < 0 || (node_id >= agg->max_nodes && node_id != AGGREGATOR_ID)) {
+		printf("Node count %d of aggregator %d exceeded. Ignoring PVs for node %d\n", agg->max_nodes, agg->id, node_id);
+		return 0;
 	}
 	memcpy(&pv_id, pv->b, sizeof(int));
+	if (pv_id < 0 || pv_id >= NUM_PV_IDS) {
+		printf("Unknown PV ID %d. Ignoring %s\n", pv_id, pv->name);
+		return 0;
+	}
 
-	// add PV to list
-	pthread_mutex_lock(&g_pv_lock);
-	PVnode *pvnode = malloc(sizeof(PVnode));
-	pvnode->node_id = node_id;
-	pvnode->pv_id = pv_id;
-	pvnode->pv = pv;
-	pvnode->next = 0;
-	if (g_first_pv == 0) {
-		g_first_pv = pvnode;
+	// add PV to table
+	if (node_id == AGGREGATOR_ID) {
+		agg->pvs[pv_id] = pv;
+		filter_attach(pv, &agg->published[pv_id]);
 	}
 	else {
-		PVnode *curr = g_first_pv;
-		while (curr->next != 0) {
-			curr = curr->next;
-		}
-		curr->next = pvnode;
+		agg->nodes[node_id].pvs[pv_id] = pv;
+		filter_attach(pv, &agg->nodes[node_id].published[pv_id]);
 	}
-	pthread_mutex_unlock(&g_pv_lock);
 
 	//printf("Registered %s\n", pv->name);
 	if (pv_id == ID_STATUS)
-		set_status(node_id, "DISCONNECTED");
+		set_status(agg, node_id, "DISCONNECTED");
 	else if (pv_id == ID_CONNECTION) 
-		set_connection(node_id, DISCONNECTED);
-	g_active[node_id] = 1;
+		set_connection(agg, node_id, DISCONNECTED);
+	else if (pv_id == ID_CONN_STATE)
+		set_pv(pv, agg->conn_state);
+	if (node_id != AGGREGATOR_ID)
+		agg->nodes[node_id].active = 1;
 	return 0;
 }
 
@@ -270,30 +501,32 @@ static long register_pv(aSubRecord *pv) {
 static long toggle_led(aSubRecord *pv) {
 	int val;
 	memcpy(&val, pv->b, sizeof(int));
-	if (val != 0) {
+	Aggregator *agg = pv_aggregator(pv);
+	if (val != 0 && agg != 0) {
 		int node_id;
 		memcpy(&node_id, pv->a, sizeof(int));
-		uint8_t command[5];
+		// LED state followed by bitmap of nodes to toggle, bit (node_id % 8) of byte (node_id / 8)
+		int len = 2 + LED_BITMAP_BYTES(agg->max_nodes);
+		uint8_t command[CMD_MAX_LEN];
+		memset(command, 0, sizeof(command));
 		command[0] = COMMAND_LED_TOGGLE;
 		if (node_id == AGGREGATOR_ID) {
-			g_led_all ^= 1;
-			command[1] = g_led_all;
-			command[2] = 0xFF;
-			command[3] = 0xFF;
-			command[4] = 0xFF;
+			agg->led_all ^= 1;
+			command[1] = agg->led_all;
+			memset(&command[2], 0xFF, len - 2);
 		}
 		else {
-			#ifdef USE_CUSTOM_IDS
-				node_id = get_actual_node_id(node_id);
-			#endif
-			int offset = node_id % 8;
-			int byte = 2 + (node_id / 8);
-			g_led_nodes[node_id] ^= 1;
-			command[1] = g_led_nodes[node_id];
-			command[byte] = 1 << offset;
+			node_id = get_actual_node_id(agg, node_id);
+			if (node_id < 0 || node_id >= agg->max_nodes) {
+				clear_trigger(pv);
+				return 0;
+			}
+			agg->nodes[node_id].led ^= 1;
+			command[1] = agg->nodes[node_id].led;
+			command[2 + node_id / 8] = 1 << (node_id % 8);
 		}
-		gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
-		set_pv(pv, 0);
+		send_command(agg, node_id, command, len);
+		clear_trigger(pv);
 	}
 	return 0;
 }
@@ -302,15 +535,17 @@ static long toggle_led(aSubRecord *pv) {
 static long toggle_sensor(aSubRecord *pv) {
 	int val, node_id, sensor_id;
 	memcpy(&val, pv->b, sizeof(int));
-	if (val != 0) {
+	Aggregator *agg = pv_aggregator(pv);
+	if (val != 0 && agg != 0) {
 		memcpy(&node_id, pv->a, sizeof(int));
 		memcpy(&sensor_id, pv->b, sizeof(int));
-		#ifdef USE_CUSTOM_IDS
-			node_id = get_actual_node_id(node_id);
-		#endif
-		aSubRecord *sensorPV = get_pv(node_id, sensor_id);
-		if (sensorPV == 0)
+		int row = node_id;
+		node_id = get_actual_node_id(agg, node_id);
+		aSubRecord *sensorPV = (node_id < 0) ? 0 : get_pv(agg, node_id, sensor_id);
+		if (sensorPV == 0) {
+			clear_trigger(pv);
 			return 0;
+		}
 		float curVal;
 		memcpy(&curVal, sensorPV->vala, sizeof(float));
 
@@ -319,42 +554,53 @@ static long toggle_sensor(aSubRecord *pv) {
 		command[1] = node_id;
 		command[2] = sensor_id;
 		command[3] = curVal ? 0 : 1;
-		gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
+		if (thingyDeriveEuler && (sensor_id == ID_EULER_TOGGLE || sensor_id == ID_HEADING_TOGGLE)) {
+			// derived from the quaternion stream by the IOC, so the node's stream is switched off
+			if (row >= 0 && row < agg->max_nodes) {
+				if (sensor_id == ID_EULER_TOGGLE)
+					agg->nodes[row].derive_euler = command[3];
+				else
+					agg->nodes[row].derive_heading = command[3];
+			}
+			command[3] = 0;
+			atomic_fetch_or(&agg->nodes[node_id].streams_off, (sensor_id == ID_EULER_TOGGLE) ? STREAM_OFF_EULER : STREAM_OFF_HEADING);
+		}
+		send_command(agg, node_id, command, sizeof(command));
 		if (sensor_id == ID_QUATERNION_TOGGLE || sensor_id == ID_RAW_MOTION_TOGGLE || sensor_id == ID_EULER_TOGGLE || sensor_id == ID_HEADING_TOGGLE)
 			set_pv(sensorPV, 1);
 		if (curVal != 0) {
 			set_pv(sensorPV, 0);
 			if (sensor_id == ID_GAS) {
-				set_pv(get_pv(node_id, ID_CO2), 0);
-				set_pv(get_pv(node_id, ID_TVOC), 0);
+				set_pv(get_pv(agg, node_id, ID_CO2), 0);
+				set_pv(get_pv(agg, node_id, ID_TVOC), 0);
 			}
 			else if (sensor_id == ID_QUATERNION_TOGGLE) {
-				set_pv(get_pv(node_id, ID_QUATERNION_W), 0);
-				set_pv(get_pv(node_id, ID_QUATERNION_X), 0);
-				set_pv(get_pv(node_id, ID_QUATERNION_Y), 0);
-				set_pv(get_pv(node_id, ID_QUATERNION_Z), 0);
+				set_pv(get_pv(agg, node_id, ID_QUATERNION_W), 0);
+				set_pv(get_pv(agg, node_id, ID_QUATERNION_X), 0);
+				set_pv(get_pv(agg, node_id, ID_QUATERNION_Y), 0);
+				set_pv(get_pv(agg, node_id, ID_QUATERNION_Z), 0);
 			}
 			else if (sensor_id == ID_RAW_MOTION_TOGGLE) {
-				set_pv(get_pv(node_id, ID_ACCEL_X), 0);
-				set_pv(get_pv(node_id, ID_ACCEL_Y), 0);
-				set_pv(get_pv(node_id, ID_ACCEL_Z), 0);
-				set_pv(get_pv(node_id, ID_GYRO_X), 0);
-				set_pv(get_pv(node_id, ID_GYRO_Y), 0);
-				set_pv(get_pv(node_id, ID_GYRO_Z), 0);
-				set_pv(get_pv(node_id, ID_COMPASS_X), 0);
-				set_pv(get_pv(node_id, ID_COMPASS_Y), 0);
-				set_pv(get_pv(node_id, ID_COMPASS_Z), 0);
+				set_pv(get_pv(agg, node_id, ID_ACCEL_X), 0);
+				set_pv(get_pv(agg, node_id, ID_ACCEL_Y), 0);
+				set_pv(get_pv(agg, node_id, ID_ACCEL_Z), 0);
+				set_pv(get_pv(agg, node_id, ID_GYRO_X), 0);
+				set_pv(get_pv(agg, node_id, ID_GYRO_Y), 0);
+				set_pv(get_pv(agg, node_id, ID_GYRO_Z), 0);
+				set_pv(get_pv(agg, node_id, ID_COMPASS_X), 0);
+				set_pv(get_pv(agg, node_id, ID_COMPASS_Y), 0);
+				set_pv(get_pv(agg, node_id, ID_COMPASS_Z), 0);
 			}
 			else if (sensor_id == ID_EULER_TOGGLE) {
-				set_pv(get_pv(node_id, ID_ROLL), 0);
-				set_pv(get_pv(node_id, ID_PITCH), 0);
-				set_pv(get_pv(node_id, ID_YAW), 0);
+				set_pv(get_pv(agg, node_id, ID_ROLL), 0);
+				set_pv(get_pv(agg, node_id, ID_PITCH), 0);
+				set_pv(get_pv(agg, node_id, ID_YAW), 0);
 			}
 			else if (sensor_id == ID_HEADING_TOGGLE) {
-				set_pv(get_pv(node_id, ID_HEADING), 0);
+				set_pv(get_pv(agg, node_id, ID_HEADING), 0);
 			}
 		}
-		set_pv(pv, 0);
+		clear_trigger(pv);
 	}
 	return 0;
 }
@@ -365,11 +611,12 @@ static long toggle_io(aSubRecord *pv) {
 	int toggled_pins;
 	memcpy(&toggled_pins, pv->b, sizeof(int));
 	// toggled_pins = logical OR of pins to toggle
-	if (toggled_pins != 0) {
+	Aggregator *agg = pv_aggregator(pv);
+	if (toggled_pins != 0 && agg != 0) {
 		int node_id;
 		memcpy(&node_id, pv->a, sizeof(int));
-		toggle_io_helper(node_id, toggled_pins);
-		set_pv(pv, 0);
+		toggle_io_helper(agg, node_id, toggled_pins);
+		clear_trigger(pv);
 	}
 	return 0;
 }
@@ -398,11 +645,12 @@ static long read_io(aSubRecord *pv) {
 static long write_env_config(aSubRecord *pv) {
 	int val;
 	memcpy(&val, pv->b, sizeof(int));
-	if (val != 0) {
+	Aggregator *agg = pv_aggregator(pv);
+	if (val != 0 && agg != 0) {
 		int node_id;
 		memcpy(&node_id, pv->a, sizeof(int));
-		write_env_config_helper(node_id);
-		set_pv(pv, 0);
+		write_env_config_helper(agg, node_id);
+		clear_trigger(pv);
 	}
 	return 0;
 }
@@ -411,11 +659,12 @@ static long write_env_config(aSubRecord *pv) {
 static long write_motion_config(aSubRecord *pv) {
 	int val;
 	memcpy(&val, pv->b, sizeof(int));
-	if (val != 0) {
+	Aggregator *agg = pv_aggregator(pv);
+	if (val != 0 && agg != 0) {
 		int node_id;
 		memcpy(&node_id, pv->a, sizeof(int));
-		write_motion_config_helper(node_id);
-		set_pv(pv, 0);
+		write_motion_config_helper(agg, node_id);
+		clear_trigger(pv);
 	}
 	return 0;
 }
@@ -424,15 +673,35 @@ static long write_motion_config(aSubRecord *pv) {
 static long write_conn_param(aSubRecord *pv) {
 	int val;
 	memcpy(&val, pv->b, sizeof(int));
-	if (val != 0) {
+	Aggregator *agg = pv_aggregator(pv);
+	if (val != 0 && agg != 0) {
 		int node_id;
 		memcpy(&node_id, pv->a, sizeof(int));
-		write_conn_param_helper(node_id);
-		set_pv(pv, 0);
+		write_conn_param_helper(agg, node_id);
+		clear_trigger(pv);
 	}
 	return 0;
 }
 
+// Decimation of a motion stream set by writing to its Decimation or DecimationMode PV
+static long set_decimation(aSubRecord *pv) {
+	Aggregator *agg = pv_aggregator(pv);
+	if (agg == 0)
+		return 0;
+	int node_id, pv_id;
+	memcpy(&node_id, pv->a, sizeof(int));
+	memcpy(&pv_id, pv->b, sizeof(int));
+	int stream = pv_id - ID_QUATERNION_DECIMATION;
+	if (node_id < 0 || node_id >= agg->max_nodes || stream < 0 || stream >= NUM_DECIMATED_STREAMS)
+		return 0;
+	float factor, mode;
+	memcpy(&factor, pv->c, sizeof(float));
+	memcpy(&mode, pv->d, sizeof(float));
+	agg->nodes[node_id].decimation_mode[stream] = (mode >= DECIMATE_MEAN && mode <= DECIMATE_MAX) ? (int)mode : DECIMATE_MEAN;
+	agg->nodes[node_id].decimation[stream] = (factor < 1) ? 1 : (int)factor;
+	return 0;
+}
+
 
 /* Register these symbols for use by IOC code: */
 epicsRegisterFunction(register_pv);
@@ -446,3 +715,10 @@ epicsRegisterFunction(read_conn_param);
 epicsRegisterFunction(write_conn_param);
 epicsRegisterFunction(read_io);
 epicsRegisterFunction(toggle_io);
+epicsRegisterFunction(set_decimation);
+
+static void thingyAggregatorRegister(void) {
+	initHookRegister(startup_hook);
+}
+
+epicsExportRegistrar(thingyAggregatorRegister);
@@ -1,69 +1,167 @@
 #ifndef THINGY_H
 #define THINGY_H
 
+#include <stdatomic.h>
+#include <pthread.h>
 #include <aSubRecord.h>
-#include "gattlib.h"
+#include "thingy_transport.h"
+#include "thingy_protocol.h"
+#include "thingy_ring.h"
+#include "thingy_commands.h"
+#include "thingy_stats.h"
+#include "thingy_capture.h"
+
+typedef struct Aggregator Aggregator;
 
 // ----------------------- METHOD SIGNATURES -----------------------
 
-aSubRecord* get_pv(int, int);
+// aggregator with given AggID, or 0
+Aggregator* get_aggregator(int);
+aSubRecord* get_pv(Aggregator*, int, int);
 int set_pv(aSubRecord*, float);
-void disconnect_node(int);
+int set_pv_array(aSubRecord*, double*, int);
+void disconnect_node(Aggregator*, int);
 
 // ----------------------- PERFORMANCE VARIABLES -----------------------
 
 // max attempts for reliable communication
 #define MAX_ATTEMPTS 5
 
-// delay (in seconds) in between attempts to reconnect to aggregator
-#define RECONNECT_DELAY 3
-
-// delay (in milliseconds) in between checks for connectivity
-#define HEARTBEAT_DELAY 90000
+// delay (in milliseconds) before first attempt to reconnect to aggregator
+// doubles after every failed attempt up to RECONNECT_MAX_DELAY, with +/-50% jitter
+#define RECONNECT_MIN_DELAY 250
+#define RECONNECT_MAX_DELAY 10000
 
+// default silence (in seconds) after which a node is considered lost
+// overridden per node by the LivenessTimeout PV
+#define LIVENESS_TIMEOUT 15
 
-// ----------------------- GLOBALS -----------------------
+// interval (in milliseconds) for publishing aggregator statistics PVs
+#define STATS_INTERVAL 1000
 
-// bluetooth UUID objects for communication with aggregator
-uuid_t g_send_uuid;
-uuid_t g_recv_uuid;
+// buckets of receive-to-publish latency histogram
+// bucket 0 counts publishes under 1 ms, bucket i those from 2^(i-1) to 2^i ms, the last bucket everything slower
+#define LATENCY_BUCKETS 12
 
-// connection object
-gatt_connection_t *gp_connection;
-// flag for broken connection
-int g_broken_conn;
+// max samples per waveform when motion data is published in blocks (thingyMotionBlock)
+#define MOTION_BLOCK_MAX 100
 
-// bitmap for nodes currently active and transmitting data
-int g_alive[MAX_NODES];
-// bitmap for nodes which are active but not transmitting data
-int g_dead[MAX_NODES];
 
-// linked list of structures to pair node/sensor IDs to PVs
-typedef struct {
-	aSubRecord *pv;
-	int node_id;
-	int pv_id;
-	struct PVnode *next;
-} PVnode;
+// ----------------------- GLOBALS -----------------------
 
-PVnode* g_first_pv;
+// max length of aggregator address given to thingyConfig()
+#define AGGREGATOR_ADDRESS_LEN 100
 
-// ----------------------- CONSTANTS -----------------------
+// number of PV IDs per node (highest PV ID + 1)
+#define NUM_PV_IDS 73
 
 // Maximum length for a Thingy's Bluetooth name
 #define MAX_NAME_LENGTH 15
 
+// motion streams that can be decimated, in order of their ID_*_DECIMATION PVs
+#define NUM_DECIMATED_STREAMS 3
+
+// state of one node
+typedef struct {
+	// PVs of node indexed by PV ID, filled once by register_pv(); empty entries are 0
+	aSubRecord *pvs[NUM_PV_IDS];
+	// node is active but not transmitting data
+	int dead;
+	// node has PVs
+	int active;
+	// LED toggle state
+	int led;
+	// last value published to each PV, see thingy_filter.h
+	float published[NUM_PV_IDS];
+	// samples per published value (1 publishes every sample) and DECIMATE_* mode
+	// of each decimated stream, set through the Decimation PVs
+	int decimation[NUM_DECIMATED_STREAMS];
+	int decimation_mode[NUM_DECIMATED_STREAMS];
+	// Euler angles and heading are derived from quaternions, set by the toggles (thingyDeriveEuler)
+	int derive_euler;
+	int derive_heading;
+	// STREAM_OFF_* bits of device streams already switched off for derived values, by hardware node ID
+	atomic_int streams_off;
+	// custom node ID assigned to hardware node ID, or -1 (thingyCustomIds)
+	int custom_id;
+	// Bluetooth name custom_id was assigned from
+	char name[MAX_NAME_LENGTH + 1];
+	// monotonic time (in ns) node was last heard from
+	atomic_ullong last_seen;
+} NodeState;
+
+// batched and block publishing state, private to thingy_helpers.c
+struct PublishState;
+
+// one aggregator and the nodes it serves, created by thingyConfig()
+// records select their aggregator with the AggID macro (INPU)
+struct Aggregator {
+	// AggID, in order of thingyConfig() calls
+	int id;
+	char address[AGGREGATOR_ADDRESS_LEN];
+	// transport to aggregator, chosen from address
+	ThingyTransport *transport;
+	// flag set while transport is connected and subscribed
+	int connected;
+	// flag for broken connection
+	int broken_conn;
+	// lock for connection object
+	pthread_mutex_t connlock;
+	// lock and condition signalled on connection state changes
+	pthread_mutex_t statelock;
+	pthread_cond_t statecond;
+	// current connection state (CONN_*)
+	int conn_state;
+	// flag to stop reconnect thread before cleanup
+	int stop;
+	// flag set once threads are started
+	int setup;
+	// LED toggle for all nodes
+	int led_all;
+
+	// number of nodes
+	int max_nodes;
+	// state of nodes 0 to max_nodes-1
+	NodeState *nodes;
+	// hardware node ID of each custom node ID, or -1; kept in step with NodeState.custom_id
+	int *actual_ids;
+	// PVs of aggregator indexed by PV ID
+	aSubRecord *pvs[NUM_PV_IDS];
+	float published[NUM_PV_IDS];
+
+	// notifications waiting for the parser thread
+	Ring ring;
+	CommandQueue commands;
+	Stats stats;
+	Capture capture;
+	struct PublishState *publish;
+	// last-known config of nodes, private to thingy_config_cache.c
+	struct ConfigCache *config_cache;
+};
+
+// aggregators by AggID
+Aggregator *gp_aggregators[MAX_AGGREGATORS];
+int g_num_aggregators;
+
+// ----------------------- CONSTANTS -----------------------
+
 // Node ID of aggregator
-#define AGGREGATOR_ID MAX_NODES + 1
+#define AGGREGATOR_ID NODE_LIMIT
 
-// Bluetooth UUIDs for aggregator characteristics
-#define UUID_RECV "3e520003-1368-b682-4440-d7dd234c45bc"
-#define UUID_SEND "3e520002-1368-b682-4440-d7dd234c45bc"
+// bytes of LED toggle bitmap; the firmware expects at least 3
+#define LED_BITMAP_BYTES(nodes) ((nodes) > 24 ? ((nodes) + 7) / 8 : 3)
 
 // Connection status
 #define CONNECTED 1
 #define DISCONNECTED 0
 
+// Aggregator connection states
+#define CONN_DISCONNECTED 0
+#define CONN_BACKOFF 1
+#define CONN_CONNECTING 2
+#define CONN_SUBSCRIBING 3
+#define CONN_CONNECTED 4
+
 // IDs for PVs
 #define ID_CONNECTION 0
 #define ID_STATUS 1
@@ -121,81 +219,45 @@ PVnode* g_first_pv;
 #define ID_EXT1 46
 #define ID_EXT2 47
 #define ID_EXT3 48
-
-// Opcodes for commands
-#define COMMAND_LED_TOGGLE 2
-#define COMMAND_ENV_CONFIG_READ 6
-#define COMMAND_ENV_CONFIG_WRITE 7
-#define COMMAND_MOTION_CONFIG_READ 8
-#define COMMAND_MOTION_CONFIG_WRITE 9 
-#define COMMAND_SET_SENSOR 10
-#define COMMAND_CONN_PARAM_READ 11
-#define COMMAND_CONN_PARAM_WRITE 12
-#define COMMAND_IO_READ 13
-#define COMMAND_IO_WRITE 14
-
-// Opcodes for responses
-#define OPCODE_CONNECT 1
-#define OPCODE_DISCONNECT 2
-#define OPCODE_BUTTON 3
-#define OPCODE_BATTERY 4
-#define OPCODE_RSSI 6
-#define OPCODE_TEMPERATURE 7
-#define OPCODE_PRESSURE 8
-#define OPCODE_HUMIDITY 9
-#define OPCODE_GAS 10
-#define OPCODE_ENV_CONFIG 11
-#define OPCODE_QUATERNIONS 12
-#define OPCODE_RAW_MOTION 13
-#define OPCODE_EULER 14
-#define OPCODE_HEADING 15
-#define OPCODE_MOTION_CONFIG 16
-#define OPCODE_CONN_PARAM 17
-#define OPCODE_EXTIO 18
-
-// Indices for every response payload
-#define RESP_OPCODE 0
-#define RESP_ID 2
-
-// Indices for each response type
-#define RESP_CONNECT_NAME 11
-
-#define RESP_BUTTON_STATE 4
-
-#define RESP_BATTERY_LEVEL 3
-
-#define RESP_RSSI_VAL 3
-
-#define RESP_TEMPERATURE_INT 3
-#define RESP_TEMPERATURE_DEC 4
-
-#define RESP_PRESSURE_INT 3 // 4 byte int
-#define RESP_PRESSURE_DEC 7
-
-#define RESP_HUMIDITY_VAL 3
-
-#define RESP_GAS_CO2 3 // 2 byte uint
-#define RESP_GAS_TVOC 5 // 2 byte uint
-
-#define RESP_QUATERNIONS_W 3 // 4 byte int 2Q30 fixed point
-#define RESP_QUATERNIONS_X 7
-#define RESP_QUATERNIONS_Y 11
-#define RESP_QUATERNIONS_Z 15
-
-#define RESP_RAW_ACCEL_X 3 // 2 byte int 6Q10 fixed point
-#define RESP_RAW_ACCEL_Y 5
-#define RESP_RAW_ACCEL_Z 7
-#define RESP_RAW_GYRO_X 9 // 11Q5 fixed point
-#define RESP_RAW_GYRO_Y 11
-#define RESP_RAW_GYRO_Z 13
-#define RESP_RAW_COMPASS_X 15 // 12Q4 fixed point
-#define RESP_RAW_COMPASS_Y 17
-#define RESP_RAW_COMPASS_Z 19
-
-#define RESP_EULER_ROLL 3 // 4 byte int 16Q16 fixed point
-#define RESP_EULER_PITCH 7
-#define RESP_EULER_YAW 11
-
-#define RESP_HEADING_VAL 3 // 4 byte int 16Q16 fixed point
+// aggregator diagnostics
+#define ID_QUEUE_DEPTH 49
+#define ID_QUEUE_HIGH_WATER 50
+#define ID_QUEUE_OVERFLOWS 51
+#define ID_COMMAND_QUEUE_DEPTH 52
+#define ID_COMMAND_LATENCY 53
+// seconds of silence before node is marked lost
+#define ID_LIVENESS_TIMEOUT 54
+// aggregator connection
+#define ID_CONN_STATE 55
+#define ID_RECOVERY_TIME 56
+// waveform blocks of motion samples
+#define ID_QUATERNION_BLOCK 57
+#define ID_RAW_MOTION_BLOCK 58
+#define ID_EULER_BLOCK 59
+#define ID_HEADING_BLOCK 60
+#define ID_PUBLISH_LATENCY 61
+// diagnostics rates, in order of STAT_* counters
+#define ID_PACKET_RATE 62
+#define ID_BYTE_RATE 63
+#define ID_DECODE_ERROR_RATE 64
+#define ID_UNKNOWN_OPCODE_RATE 65
+#define ID_PUBLISH_RATE 66
+#define ID_COMMAND_RATE 67
+#define ID_COMMAND_FAILURE_RATE 68
+// decimation of motion streams, with both Decimation and DecimationMode as inputs
+#define ID_QUATERNION_DECIMATION 69
+#define ID_RAW_MOTION_DECIMATION 70
+#define ID_EULER_DECIMATION 71
+// set once every PV has been published after the IOC started
+#define ID_INITIAL_PUBLISH 72
+
+// streams switched off on the device when derived from quaternions (thingyDeriveEuler)
+#define STREAM_OFF_EULER 1
+#define STREAM_OFF_HEADING 2
+
+// Decimation modes, published per window of samples
+#define DECIMATE_MEAN 0
+#define DECIMATE_MIN 1
+#define DECIMATE_MAX 2
 
 #endif
@@ -0,0 +1,316 @@
+// Microbenchmark of the decode and publish hot path, eg.
+//   thingy_bench 200000 > bench.jsonl
+// Runs parse_resp() on synthetic responses of every data opcode for 1 to MAX_NODES
+// nodes, plus get_pv(), set_pv() and disconnect_node() (which nullifies every PV
+// of a node). The publish path runs as in a started IOC, through the change filter
+// and batching, but the record layer is stubbed below: scanOnce() queues nothing,
+// batch callbacks run inline on the benchmark thread and records are not processed.
+//
+// Output is one JSON object per line:
+//   {"bench":"parse_resp","opcode":12,"nodes":19,"ops":200000,"ns_per_op":41.2,
+//    "p50":40.1,"p90":44.0,"p99":61.3,"max":812.5,"allocs_per_op":0,"frees_per_op":0}
+// Percentiles are of the mean time per op over batches of BENCH_BATCH ops.
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <dbAccess.h>
+#include <dbScan.h>
+#include <dbLock.h>
+#include <callback.h>
+#include <aSubRecord.h>
+
+#include "thingy_shared.h"
+#include "thingy_aggregator.h"
+#include "thingy_helpers.h"
+#include "thingy_filter.h"
+
+// ops timed together for one percentile sample
+#define BENCH_BATCH 32
+// default ops per benchmark
+#define BENCH_ITERATIONS 100000
+// length of synthetic responses; at least the longest response of any opcode
+#define BENCH_PACKET_LEN 24
+// bytes allocated for every output array of a record
+#define BENCH_VAL_SIZE 64
+
+// opcodes decoded into PVs; connect/disconnect only log and are left out
+static const int g_bench_opcodes[] = {
+	OPCODE_BUTTON, OPCODE_BATTERY, OPCODE_RSSI, OPCODE_TEMPERATURE, OPCODE_PRESSURE,
+	OPCODE_HUMIDITY, OPCODE_GAS, OPCODE_ENV_CONFIG, OPCODE_QUATERNIONS, OPCODE_RAW_MOTION,
+	OPCODE_EULER, OPCODE_HEADING, OPCODE_MOTION_CONFIG, OPCODE_CONN_PARAM, OPCODE_EXTIO,
+};
+#define NUM_BENCH_OPCODES (sizeof(g_bench_opcodes) / sizeof(g_bench_opcodes[0]))
+
+// node counts each opcode is run with
+static const int g_bench_nodes[] = { 1, 2, 4, 8, 16, MAX_NODES };
+#define NUM_BENCH_NODES (sizeof(g_bench_nodes) / sizeof(g_bench_nodes[0]))
+
+/*
+ *	allocation counting
+ *	glibc allocator entry points are wrapped so allocations on the hot path show up
+ */
+
+static atomic_ulong g_allocs;
+static atomic_ulong g_frees;
+
+#ifdef __GLIBC__
+	extern void *__libc_malloc(size_t);
+	extern void *__libc_calloc(size_t, size_t);
+	extern void *__libc_realloc(void*, size_t);
+	extern void __libc_free(void*);
+
+	void *malloc(size_t size) {
+		atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+		return __libc_malloc(size);
+	}
+
+	void *calloc(size_t n, size_t size) {
+		atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+		return __libc_calloc(n, size);
+	}
+
+	void *realloc(void *p, size_t size) {
+		atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+		return __libc_realloc(p, size);
+	}
+
+	void free(void *p) {
+		if (p != 0)
+			atomic_fetch_add_explicit(&g_frees, 1, memory_order_relaxed);
+		__libc_free(p);
+	}
+	#define ALLOCS_COUNTED 1
+#else
+	#define ALLOCS_COUNTED 0
+#endif
+
+/*
+ *	record layer
+ *	stands in for the IOC's scan and callback threads so the publish path can run without a database
+ */
+
+// queued scans would be processed by the IOC's scanOnce thread; nothing to do
+int scanOnce(struct dbCommon *precord) {
+	return 0;
+}
+
+// batches are published inline, as the callback thread would
+int callbackRequest(CALLBACK *pcallback) {
+	pcallback->callback(pcallback);
+	return 0;
+}
+
+// any non-null lock set; records are never locked
+static char g_locker;
+
+dbLocker *dbLockerAlloc(dbCommon * const *precs, size_t nrecs, unsigned int flags) {
+	return (dbLocker*)&g_locker;
+}
+
+void dbLockerFree(dbLocker *locker) {
+}
+
+void dbScanLockMany(dbLocker *locker) {
+}
+
+void dbScanUnlockMany(dbLocker *locker) {
+}
+
+void dbScanLock(dbCommon *precord) {
+}
+
+void dbScanUnlock(dbCommon *precord) {
+}
+
+long dbProcess(dbCommon *precord) {
+	return 0;
+}
+
+/*
+ *	timing
+ */
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct {
+	const char *name;
+	int opcode;
+	int nodes;
+	long ops;
+	uint64_t total_ns;
+	unsigned long allocs;
+	unsigned long frees;
+	int num_samples;
+	double *samples;
+} BenchResult;
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int count, double p) {
+	int i = (int)(p * (count - 1) + 0.5);
+	return sorted[i];
+}
+
+static void report(BenchResult *r) {
+	qsort(r->samples, r->num_samples, sizeof(double), compare_double);
+	printf("{\"bench\":\"%s\",\"opcode\":%d,\"nodes\":%d,\"ops\":%ld,\"ns_per_op\":%.1f,"
+		"\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f,\"allocs_per_op\":",
+		r->name, r->opcode, r->nodes, r->ops, (double)r->total_ns / r->ops,
+		percentile(r->samples, r->num_samples, 0.5), percentile(r->samples, r->num_samples, 0.9),
+		percentile(r->samples, r->num_samples, 0.99), r->samples[r->num_samples - 1]);
+	if (ALLOCS_COUNTED)
+		printf("%.3f,\"frees_per_op\":%.3f}\n", (double)r->allocs / r->ops, (double)r->frees / r->ops);
+	else
+		printf("null,\"frees_per_op\":null}\n");
+	fflush(stdout);
+}
+
+/*
+ *	benchmarks
+ *	each runs ops in batches, calling op(i) for op index i
+ */
+
+typedef void (*bench_op)(long, void*);
+
+static void run_bench(const char *name, int opcode, int nodes, long iterations, bench_op op, void *arg) {
+	BenchResult r = { name, opcode, nodes };
+	r.num_samples = iterations / BENCH_BATCH;
+	if (r.num_samples < 1)
+		r.num_samples = 1;
+	r.samples = malloc(r.num_samples * sizeof(double));
+	r.ops = (long)r.num_samples * BENCH_BATCH;
+
+	// warm up caches and lazily created state
+	for (long i=0; i<BENCH_BATCH; i++)
+		op(i, arg);
+
+	unsigned long allocs = atomic_load(&g_allocs);
+	unsigned long frees = atomic_load(&g_frees);
+	long i = 0;
+	for (int s=0; s<r.num_samples; s++) {
+		uint64_t start = now_ns();
+		for (int j=0; j<BENCH_BATCH; j++, i++)
+			op(i, arg);
+		uint64_t elapsed = now_ns() - start;
+		r.total_ns += elapsed;
+		r.samples[s] = (double)elapsed / BENCH_BATCH;
+	}
+	r.allocs = atomic_load(&g_allocs) - allocs;
+	r.frees = atomic_load(&g_frees) - frees;
+	report(&r);
+	free(r.samples);
+}
+
+// aggregator all benchmarks run against
+static Aggregator *gp_agg;
+
+typedef struct {
+	int nodes;
+	uint8_t packets[MAX_NODES][BENCH_PACKET_LEN];
+} PacketSet;
+
+static void parse_op(long i, void *arg) {
+	PacketSet *set = arg;
+	parse_resp(gp_agg, set->packets[i % set->nodes], BENCH_PACKET_LEN, 0);
+}
+
+static void get_pv_op(long i, void *arg) {
+	int *nodes = arg;
+	get_pv(gp_agg, i % *nodes, (i * 7) % NUM_PV_IDS);
+}
+
+static void set_pv_op(long i, void *arg) {
+	int *nodes = arg;
+	set_pv(gp_agg->nodes[i % *nodes].pvs[ID_TEMPERATURE], (float)i);
+}
+
+static void disconnect_op(long i, void *arg) {
+	int *nodes = arg;
+	disconnect_node(gp_agg, i % *nodes);
+}
+
+// fill payload with pseudo-random data, keeping opcode and node ID
+static void make_packet(uint8_t *resp, int opcode, int node_id, uint32_t *seed) {
+	for (int i=0; i<BENCH_PACKET_LEN; i++) {
+		*seed ^= *seed << 13;
+		*seed ^= *seed >> 17;
+		*seed ^= *seed << 5;
+		resp[i] = *seed & 0xFF;
+	}
+	resp[RESP_OPCODE] = opcode;
+	resp[1] = 0;
+	resp[RESP_ID] = node_id;
+}
+
+static aSubRecord *make_record(int node_id, int pv_id) {
+	aSubRecord *pv = calloc(1, sizeof(aSubRecord));
+	snprintf(pv->name, sizeof(pv->name), "bench:%d:%d", node_id, pv_id);
+	// node and PV IDs, as INPA/INPB give them
+	pv->a = calloc(1, sizeof(int));
+	pv->b = calloc(1, sizeof(int));
+	memcpy(pv->a, &node_id, sizeof(int));
+	memcpy(pv->b, &pv_id, sizeof(int));
+	void **outs = &pv->vala;
+	epicsUInt32 *nova = &pv->nova;
+	for (int i=0; i<3; i++) {
+		outs[i] = calloc(1, BENCH_VAL_SIZE);
+		nova[i] = BENCH_VAL_SIZE / sizeof(double);
+	}
+	return pv;
+}
+
+// create a record for every node and PV ID of an unconnected aggregator, as register_pv() would
+static void make_records() {
+	gp_agg = get_aggregator(aggregator_create("bench", MAX_NODES));
+	for (int pv_id=0; pv_id<NUM_PV_IDS; pv_id++) {
+		gp_agg->pvs[pv_id] = make_record(AGGREGATOR_ID, pv_id);
+		filter_attach(gp_agg->pvs[pv_id], &gp_agg->published[pv_id]);
+	}
+	for (int node_id=0; node_id<gp_agg->max_nodes; node_id++) {
+		for (int pv_id=0; pv_id<NUM_PV_IDS; pv_id++) {
+			gp_agg->nodes[node_id].pvs[pv_id] = make_record(node_id, pv_id);
+			filter_attach(gp_agg->nodes[node_id].pvs[pv_id], &gp_agg->nodes[node_id].published[pv_id]);
+		}
+	}
+}
+
+
+int main(int argc, char *argv[]) {
+	long iterations = (argc > 1) ? atol(argv[1]) : BENCH_ITERATIONS;
+	if (iterations < BENCH_BATCH) {
+		fprintf(stderr, "Usage: %s [iterations >= %d]\n", argv[0], BENCH_BATCH);
+		return 1;
+	}
+	make_records();
+	// filter, batching and blocks are only active once the IOC has started
+	g_ioc_started = 1;
+
+	uint32_t seed = 2463534242u;
+	PacketSet set;
+	for (int n=0; n<NUM_BENCH_NODES; n++) {
+		set.nodes = g_bench_nodes[n];
+		for (int o=0; o<NUM_BENCH_OPCODES; o++) {
+			for (int node_id=0; node_id<set.nodes; node_id++)
+				make_packet(set.packets[node_id], g_bench_opcodes[o], node_id, &seed);
+			run_bench("parse_resp", g_bench_opcodes[o], set.nodes, iterations, parse_op, &set);
+		}
+		run_bench("get_pv", -1, set.nodes, iterations, get_pv_op, &set.nodes);
+		run_bench("set_pv", -1, set.nodes, iterations, set_pv_op, &set.nodes);
+	}
+	// touches every PV of a node, so run fewer
+	int nodes = MAX_NODES;
+	run_bench("disconnect_node", -1, nodes, iterations / 100 + BENCH_BATCH, disconnect_op, &nodes);
+	return 0;
+}
@@ -0,0 +1,158 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <iocsh.h>
+#include <epicsExport.h>
+
+#include "thingy_shared.h"
+#include "thingy_aggregator.h"
+#include "thingy_capture.h"
+
+static double g_replay_speed = 1;
+
+static void buffer_put(Capture *cap, size_t pos, const uint8_t *data, size_t len) {
+	size_t offset = pos & (CAPTURE_BUFFER_SIZE - 1);
+	size_t first = (len < CAPTURE_BUFFER_SIZE - offset) ? len : CAPTURE_BUFFER_SIZE - offset;
+	memcpy(&cap->buffer[offset], data, first);
+	memcpy(cap->buffer, data + first, len - first);
+}
+
+void capture_notification(Capture *cap, const uint8_t *data, size_t len, uint64_t time_ns) {
+	if (!atomic_load_explicit(&cap->capturing, memory_order_acquire))
+		return;
+	size_t head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&cap->tail, memory_order_acquire);
+	if (len > CAPTURE_MAX_PAYLOAD || CAPTURE_BUFFER_SIZE - (head - tail) < CAPTURE_RECORD_HEADER + len) {
+		// writer is behind; drop rather than stall the transport thread
+		atomic_fetch_add_explicit(&cap->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	uint8_t header[CAPTURE_RECORD_HEADER];
+	for (int i=0; i<8; i++)
+		header[i] = (time_ns >> (8 * i)) & 0xFF;
+	header[8] = len;
+	buffer_put(cap, head, header, CAPTURE_RECORD_HEADER);
+	buffer_put(cap, head + CAPTURE_RECORD_HEADER, data, len);
+	atomic_store_explicit(&cap->head, head + CAPTURE_RECORD_HEADER + len, memory_order_release);
+}
+
+// thread function to write buffered notifications to file until capture stops
+static void* capture_writer(void *arg) {
+	Capture *cap = arg;
+	while (1) {
+		size_t head = atomic_load_explicit(&cap->head, memory_order_acquire);
+		size_t tail = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+		if (head != tail) {
+			size_t offset = tail & (CAPTURE_BUFFER_SIZE - 1);
+			size_t len = head - tail;
+			if (len > CAPTURE_BUFFER_SIZE - offset)
+				len = CAPTURE_BUFFER_SIZE - offset;
+			fwrite(&cap->buffer[offset], 1, len, cap->file);
+			atomic_store_explicit(&cap->tail, tail + len, memory_order_release);
+		}
+		else if (!atomic_load_explicit(&cap->capturing, memory_order_acquire)) {
+			break;
+		}
+		else {
+			fflush(cap->file);
+			usleep(CAPTURE_FLUSH_INTERVAL * 1000);
+		}
+	}
+	fclose(cap->file);
+	cap->file = 0;
+	return 0;
+}
+
+int capture_start(Capture *cap, const char *path) {
+	if (atomic_load(&cap->capturing)) {
+		printf("Capture already running\n");
+		return 1;
+	}
+	if (cap->buffer == 0)
+		cap->buffer = malloc(CAPTURE_BUFFER_SIZE);
+	if (cap->buffer == 0) {
+		printf("Failed to allocate capture buffer\n");
+		return 1;
+	}
+	cap->file = fopen(path, "ab");
+	if (cap->file == 0) {
+		printf("Failed to open capture file %s\n", path);
+		return 1;
+	}
+	if (ftell(cap->file) == 0)
+		fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, cap->file);
+	atomic_store(&cap->dropped, 0);
+	atomic_store(&cap->capturing, 1);
+	pthread_create(&cap->writer, NULL, &capture_writer, cap);
+	printf("Capturing notifications to %s\n", path);
+	return 0;
+}
+
+void capture_stop(Capture *cap) {
+	if (!atomic_load(&cap->capturing))
+		return;
+	atomic_store(&cap->capturing, 0);
+	pthread_join(cap->writer, NULL);
+	printf("Capture stopped. %lu notifications dropped\n", atomic_load(&cap->dropped));
+}
+
+double replay_speed() {
+	return g_replay_speed;
+}
+
+/*
+ *	iocsh commands
+ */
+
+static const iocshArg captureStartArg0 = {"file", iocshArgString};
+static const iocshArg captureStartArg1 = {"AggID", iocshArgInt};
+static const iocshArg * const captureStartArgs[] = {&captureStartArg0, &captureStartArg1};
+static const iocshFuncDef captureStartDef = {"thingyCaptureStart", 2, captureStartArgs};
+static void captureStartCallFunc(const iocshArgBuf *args) {
+	Aggregator *agg = get_aggregator(args[1].ival);
+	if (args[0].sval == 0 || agg == 0) {
+		printf("Usage: thingyCaptureStart <file> [AggID]\n");
+		return;
+	}
+	capture_start(&agg->capture, args[0].sval);
+}
+
+static const iocshArg captureStopArg0 = {"AggID", iocshArgInt};
+static const iocshArg * const captureStopArgs[] = {&captureStopArg0};
+static const iocshFuncDef captureStopDef = {"thingyCaptureStop", 1, captureStopArgs};
+static void captureStopCallFunc(const iocshArgBuf *args) {
+	Aggregator *agg = get_aggregator(args[0].ival);
+	if (agg != 0)
+		capture_stop(&agg->capture);
+}
+
+// add aggregator replaying a capture, in place of thingyConfig(); must be called before iocInit
+// the speed applies to every replay
+static const iocshArg replayArg0 = {"file", iocshArgString};
+static const iocshArg replayArg1 = {"speed", iocshArgDouble};
+static const iocshArg replayArg2 = {"node count", iocshArgInt};
+static const iocshArg * const replayArgs[] = {&replayArg0, &replayArg1, &replayArg2};
+static const iocshFuncDef replayDef = {"thingyReplay", 3, replayArgs};
+static void replayCallFunc(const iocshArgBuf *args) {
+	if (args[0].sval == 0 || args[1].dval < 0) {
+		printf("Usage: thingyReplay <file> <speed> [nodes]; speed 1 is real time, 0 as fast as possible\n");
+		return;
+	}
+	g_replay_speed = args[1].dval;
+	char address[AGGREGATOR_ADDRESS_LEN];
+	snprintf(address, sizeof(address), "%s%s", REPLAY_PREFIX, args[0].sval);
+	aggregator_create(address, args[2].ival > 0 ? args[2].ival : MAX_NODES);
+}
+
+static void thingyCaptureRegister(void) {
+	iocshRegister(&captureStartDef, captureStartCallFunc);
+	iocshRegister(&captureStopDef, captureStopCallFunc);
+	iocshRegister(&replayDef, replayCallFunc);
+}
+
+epicsExportRegistrar(thingyCaptureRegister);
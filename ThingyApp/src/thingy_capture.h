@@ -0,0 +1,56 @@
+#ifndef THINGY_CAPTURE_H
+#define THINGY_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Binary capture of raw aggregator notifications, for replay with the
+// replay transport (thingyReplay() or thingyConfig("replay:<file>")).
+//
+// File layout: CAPTURE_MAGIC, then one record per notification:
+//   8 bytes   CLOCK_MONOTONIC receive time in ns, little endian
+//   1 byte    payload length
+//   payload   raw notification (RESP_OPCODE, ...)
+// Captures are opened for append, so several sessions can share a file.
+// Each aggregator is captured separately, to a file of its own.
+
+#define CAPTURE_MAGIC "THNGCAP1"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_RECORD_HEADER 9
+#define CAPTURE_MAX_PAYLOAD 255
+
+// bytes buffered between notification thread and writer thread; must be a power of 2
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+// interval (in ms) at which writer thread flushes to file when idle
+#define CAPTURE_FLUSH_INTERVAL 100
+
+#define REPLAY_PREFIX "replay:"
+
+// capture state of one aggregator
+typedef struct {
+	// byte ring between notification thread (producer) and writer thread (consumer)
+	// head and tail count bytes ever written/consumed and are never reset
+	// allocated on first capture_start()
+	uint8_t *buffer;
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_int capturing;
+	atomic_ulong dropped;
+	FILE *file;
+	pthread_t writer;
+} Capture;
+
+// start writing notifications to file; returns 0 on success
+int capture_start(Capture*, const char*);
+// flush remaining notifications and close file
+void capture_stop(Capture*);
+// record notification with its monotonic receive time (ns); never blocks
+void capture_notification(Capture*, const uint8_t*, size_t, uint64_t);
+
+// replay speed set by thingyReplay(); 1 is real time, 0 as fast as possible
+double replay_speed();
+
+#endif
@@ -0,0 +1,146 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <dbAccess.h>
+#include <dbScan.h>
+#include <aSubRecord.h>
+#include <epicsExport.h>
+
+#include "thingy_shared.h"
+#include "thingy_aggregator.h"
+#include "thingy_helpers.h"
+#include "thingy_commands.h"
+#include "thingy_stats.h"
+
+// minimum time (in microseconds) between commands written to the aggregator
+int thingyCommandInterval = 5000;
+epicsExportAddress(int, thingyCommandInterval);
+
+static void* command_writer(void*);
+
+static double elapsed_ms(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+// write commands replace a pending write of the same opcode to the same node
+static int is_write_command(uint8_t opcode) {
+	return opcode == COMMAND_ENV_CONFIG_WRITE || opcode == COMMAND_MOTION_CONFIG_WRITE ||
+		opcode == COMMAND_CONN_PARAM_WRITE || opcode == COMMAND_IO_WRITE;
+}
+
+void command_queue_start(Aggregator *agg) {
+	CommandQueue *q = &agg->commands;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, &attr);
+	pthread_t writer;
+	pthread_create(&writer, NULL, &command_writer, agg);
+}
+
+int send_command(Aggregator *agg, int node_id, uint8_t *command, size_t len) {
+	if (agg == 0 || agg->transport == 0 || agg->connected == 0 || len == 0 || len > CMD_MAX_LEN)
+		return 1;
+
+	CommandQueue *q = &agg->commands;
+	pthread_mutex_lock(&q->lock);
+	// coalesce with a pending duplicate, or newer values for a pending write
+	for (int i=0; i<q->count; i++) {
+		Command *pending = &q->queue[(q->head + i) % CMD_QUEUE_SIZE];
+		if (pending->len != len || pending->data[0] != command[0])
+			continue;
+		int same = memcmp(pending->data, command, len) == 0;
+		if (same || (is_write_command(command[0]) && pending->data[1] == command[1])) {
+			memcpy(pending->data, command, len);
+			pending->node_id = node_id;
+			pthread_mutex_unlock(&q->lock);
+			return 0;
+		}
+	}
+	if (q->count == CMD_QUEUE_SIZE) {
+		pthread_mutex_unlock(&q->lock);
+		printf("WARNING: Aggregator %d command queue full. Dropping command %d\n", agg->id, command[0]);
+		return 1;
+	}
+	Command *cmd = &q->queue[(q->head + q->count) % CMD_QUEUE_SIZE];
+	memcpy(cmd->data, command, len);
+	cmd->len = len;
+	cmd->node_id = node_id;
+	clock_gettime(CLOCK_MONOTONIC, &cmd->queued);
+	q->count++;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+// publish command queue depth and mean queue latency per opcode
+static void publish_command_stats(Aggregator *agg, int depth) {
+	CommandQueue *q = &agg->commands;
+	double latency[NUM_COMMANDS];
+	for (int i=0; i<NUM_COMMANDS; i++) {
+		latency[i] = q->latency_count[i] ? q->latency_sum[i] / q->latency_count[i] : 0;
+		q->latency_sum[i] = 0;
+		q->latency_count[i] = 0;
+	}
+	set_pv(get_pv(agg, AGGREGATOR_ID, ID_COMMAND_QUEUE_DEPTH), depth);
+	set_pv_array(get_pv(agg, AGGREGATOR_ID, ID_COMMAND_LATENCY), latency, NUM_COMMANDS);
+}
+
+// thread function to write queued commands to aggregator one at a time
+static void* command_writer(void *arg) {
+	Aggregator *agg = arg;
+	CommandQueue *q = &agg->commands;
+	Command cmd;
+	struct timespec now, last_send, next_stats;
+	clock_gettime(CLOCK_MONOTONIC, &last_send);
+	next_stats = last_send;
+	while(1) {
+		pthread_mutex_lock(&q->lock);
+		while (q->count == 0) {
+			if (pthread_cond_timedwait(&q->cond, &q->lock, &next_stats) != 0)
+				break;
+		}
+		int depth = q->count;
+		if (depth > 0) {
+			cmd = q->queue[q->head];
+			q->head = (q->head + 1) % CMD_QUEUE_SIZE;
+			q->count--;
+		}
+		pthread_mutex_unlock(&q->lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (elapsed_ms(&next_stats, &now) >= 0) {
+			if (g_ioc_started)
+				publish_command_stats(agg, depth);
+			next_stats = now;
+			next_stats.tv_sec += STATS_INTERVAL / 1000;
+			next_stats.tv_nsec += (STATS_INTERVAL % 1000) * 1000000L;
+			if (next_stats.tv_nsec >= 1000000000L) {
+				next_stats.tv_sec++;
+				next_stats.tv_nsec -= 1000000000L;
+			}
+		}
+		if (depth == 0)
+			continue;
+
+		// rate limit
+		double wait_us = thingyCommandInterval - elapsed_ms(&last_send, &now) * 1000;
+		if (wait_us > 0)
+			usleep(wait_us);
+
+		// commands are dropped while disconnected
+		int failed = !agg->connected || agg->transport->write(agg->transport, cmd.data, cmd.len) != 0;
+		stats_add(&agg->stats, cmd.node_id, cmd.data[0], failed ? STAT_COMMAND_FAILURES : STAT_COMMANDS, 1);
+		clock_gettime(CLOCK_MONOTONIC, &last_send);
+		if (cmd.data[0] < NUM_COMMANDS) {
+			q->latency_sum[cmd.data[0]] += elapsed_ms(&cmd.queued, &last_send);
+			q->latency_count[cmd.data[0]]++;
+		}
+	}
+	return 0;
+}
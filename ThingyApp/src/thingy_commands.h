@@ -0,0 +1,50 @@
+#ifndef THINGY_COMMANDS_H
+#define THINGY_COMMANDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+// Serialized command queue to each aggregator.
+// Commands from any thread are queued by send_command() and written one at
+// a time by a single writer thread, rate limited to what the link sustains.
+
+// max commands waiting to be sent
+#define CMD_QUEUE_SIZE 256
+// max command payload; the LED toggle bitmap for NODE_LIMIT nodes is the longest
+#define CMD_MAX_LEN 40
+// number of command opcodes tracked for latency (highest COMMAND_* + 1)
+#define NUM_COMMANDS 15
+
+typedef struct {
+	uint8_t data[CMD_MAX_LEN];
+	size_t len;
+	// node the command is counted against; not every payload carries it in the same byte
+	int node_id;
+	struct timespec queued;
+} Command;
+
+// command queue of one aggregator
+typedef struct {
+	// circular queue of pending commands
+	Command queue[CMD_QUEUE_SIZE];
+	int head;
+	int count;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// queue latency per command opcode since last publish
+	double latency_sum[NUM_COMMANDS];
+	int latency_count[NUM_COMMANDS];
+} CommandQueue;
+
+struct Aggregator;
+
+// start writer thread of aggregator
+void command_queue_start(struct Aggregator*);
+
+// queue command payload for aggregator, addressed to given actual node ID (AGGREGATOR_ID for all nodes)
+// returns 0 if queued or coalesced with a pending command, 1 if dropped
+int send_command(struct Aggregator*, int, uint8_t*, size_t);
+
+#endif
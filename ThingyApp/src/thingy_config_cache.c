@@ -0,0 +1,131 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <epicsExport.h>
+#include <epicsTime.h>
+
+#include "thingy_shared.h"
+#include "thingy_aggregator.h"
+#include "thingy_helpers.h"
+#include "thingy_filter.h"
+#include "thingy_config_cache.h"
+
+// max age (in milliseconds) of cached config served to a read; 0 always reads from the node
+int thingyConfigMaxAge = 60000;
+epicsExportAddress(int, thingyConfigMaxAge);
+
+// config opcodes cached per node
+#define NUM_CONFIGS 4
+// most fields of any config response
+#define CONFIG_FIELDS 5
+
+typedef struct {
+	// monotonic time (in ns) the config was received, 0 if not cached
+	uint64_t received;
+	// receive time the values are republished with
+	epicsTimeStamp stamp;
+	int count;
+	int pv_ids[CONFIG_FIELDS];
+	float vals[CONFIG_FIELDS];
+} CachedConfig;
+
+struct ConfigCache {
+	// stored by the parser thread, read by threads processing the read PVs
+	pthread_mutex_t lock;
+	// indexed [node_id * NUM_CONFIGS + config]
+	CachedConfig *configs;
+};
+
+// slot of config opcode, or -1 if not cached
+static int config_index(int opcode) {
+	switch (opcode) {
+		case OPCODE_ENV_CONFIG: return 0;
+		case OPCODE_MOTION_CONFIG: return 1;
+		case OPCODE_CONN_PARAM: return 2;
+		case OPCODE_EXTIO: return 3;
+		default: return -1;
+	}
+}
+
+// config opcode a read command is answered with, or -1
+static int read_opcode(int command) {
+	switch (command) {
+		case COMMAND_ENV_CONFIG_READ: return OPCODE_ENV_CONFIG;
+		case COMMAND_MOTION_CONFIG_READ: return OPCODE_MOTION_CONFIG;
+		case COMMAND_CONN_PARAM_READ: return OPCODE_CONN_PARAM;
+		case COMMAND_IO_READ: return OPCODE_EXTIO;
+		default: return -1;
+	}
+}
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int config_cache_init(Aggregator *agg) {
+	struct ConfigCache *cache = calloc(1, sizeof(struct ConfigCache));
+	if (cache == 0)
+		return 1;
+	cache->configs = calloc(agg->max_nodes * NUM_CONFIGS, sizeof(CachedConfig));
+	if (cache->configs == 0)
+		return 1;
+	pthread_mutex_init(&cache->lock, NULL);
+	agg->config_cache = cache;
+	return 0;
+}
+
+void config_cache_store(Aggregator *agg, int node_id, int opcode, const float *vals, const int *pv_ids, int n, const epicsTimeStamp *stamp) {
+	int index = config_index(opcode);
+	if (index < 0 || node_id < 0 || node_id >= agg->max_nodes || n > CONFIG_FIELDS)
+		return;
+	struct ConfigCache *cache = agg->config_cache;
+	CachedConfig *config = &cache->configs[node_id * NUM_CONFIGS + index];
+	pthread_mutex_lock(&cache->lock);
+	config->stamp = *stamp;
+	config->count = n;
+	memcpy(config->pv_ids, pv_ids, n * sizeof(int));
+	memcpy(config->vals, vals, n * sizeof(float));
+	config->received = now_ns();
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int config_cache_read(Aggregator *agg, int node_id, int command) {
+	int index = config_index(read_opcode(command));
+	if (index < 0 || node_id < 0 || node_id >= agg->max_nodes || thingyConfigMaxAge <= 0)
+		return 0;
+	struct ConfigCache *cache = agg->config_cache;
+	CachedConfig config;
+	pthread_mutex_lock(&cache->lock);
+	config = cache->configs[node_id * NUM_CONFIGS + index];
+	pthread_mutex_unlock(&cache->lock);
+	if (config.received == 0 || now_ns() - config.received > (uint64_t)thingyConfigMaxAge * 1000000ULL)
+		return 0;
+	// published as if the response had just been parsed again
+	for (int i=0; i<config.count; i++) {
+		aSubRecord *pv = get_pv(agg, node_id, config.pv_ids[i]);
+		if (pv == 0 || !value_changed(pv, config.pv_ids[i], config.vals[i]))
+			continue;
+		memcpy(pv->vala, &config.vals[i], sizeof(float));
+		scan_pv(pv, &config.stamp);
+	}
+	return 1;
+}
+
+void config_cache_invalidate(Aggregator *agg, int node_id, int opcode) {
+	if (node_id < 0 || node_id >= agg->max_nodes)
+		return;
+	struct ConfigCache *cache = agg->config_cache;
+	int index = config_index(opcode);
+	pthread_mutex_lock(&cache->lock);
+	for (int i=0; i<NUM_CONFIGS; i++) {
+		if (opcode == -1 || i == index)
+			cache->configs[node_id * NUM_CONFIGS + i].received = 0;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
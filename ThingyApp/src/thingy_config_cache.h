@@ -0,0 +1,27 @@
+#ifndef THINGY_CONFIG_CACHE_H
+#define THINGY_CONFIG_CACHE_H
+
+#include <epicsTime.h>
+
+// last-known environment, motion, connection parameter and IO config of every node,
+// taken from the node's config responses. Reads triggered through the config read PVs
+// are answered from the cache while it is younger than thingyConfigMaxAge instead of
+// sending a read command over the air. Indexed by actual node ID.
+// A node's config is dropped when it disconnects and when the IOC writes it.
+
+struct Aggregator;
+
+// allocate cache of aggregator, all empty; returns nonzero on failure
+int config_cache_init(struct Aggregator*);
+
+// remember values decoded from a config response of node; other opcodes are ignored
+void config_cache_store(struct Aggregator*, int, int, const float*, const int*, int, const epicsTimeStamp*);
+
+// publish cached config of node for given read command
+// returns 1 if served from the cache, 0 if the command must be sent
+int config_cache_read(struct Aggregator*, int, int);
+
+// drop cached config of node for given config opcode, or every config for -1
+void config_cache_invalidate(struct Aggregator*, int, int);
+
+#endif
@@ -0,0 +1,287 @@
+// Stand-in for the NRF52DK aggregator speaking the socket transport framing.
+// Streams synthetic sensor data for a number of nodes so the IOC can be run
+// without a radio, eg.
+//   thingy_fake_aggregator unix:/tmp/thingy.sock 19 100
+// then use thingyConfig("unix:/tmp/thingy.sock") in st.cmd
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "thingy_transport.h"
+#include "thingy_protocol.h"
+
+#define MAX_FAKE_NODES 255
+#define NAME_OFFSET 11
+
+static int g_fd = -1;
+static pthread_mutex_t g_writelock = PTHREAD_MUTEX_INITIALIZER;
+
+// config values echoed back on read commands
+static uint8_t g_env_config[MAX_FAKE_NODES][9];
+static uint8_t g_motion_config[MAX_FAKE_NODES][9];
+static uint8_t g_conn_param[MAX_FAKE_NODES][8];
+static uint8_t g_io[MAX_FAKE_NODES][4];
+
+static int send_frame(const uint8_t *data, size_t len) {
+	uint8_t frame[SOCKET_MAX_PAYLOAD + 1];
+	frame[0] = len;
+	memcpy(&frame[1], data, len);
+	size_t sent = 0;
+	pthread_mutex_lock(&g_writelock);
+	while (sent < len + 1) {
+		ssize_t n = send(g_fd, frame + sent, len + 1 - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			pthread_mutex_unlock(&g_writelock);
+			return 1;
+		}
+		sent += n;
+	}
+	pthread_mutex_unlock(&g_writelock);
+	return 0;
+}
+
+static void put16(uint8_t *p, int16_t v) {
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+}
+
+static void put32(uint8_t *p, int32_t v) {
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+static int send_config(int opcode, int node, const uint8_t *data, size_t len) {
+	uint8_t resp[20];
+	memset(resp, 0, sizeof(resp));
+	resp[RESP_OPCODE] = opcode;
+	resp[RESP_ID] = node;
+	memcpy(&resp[3], data, len);
+	return send_frame(resp, 3 + len);
+}
+
+// answer commands sent by the IOC
+static void* command_reader(void *arg) {
+	uint8_t len;
+	uint8_t cmd[SOCKET_MAX_PAYLOAD];
+	int fd = g_fd;
+	while (1) {
+		if (recv(fd, &len, 1, MSG_WAITALL) != 1)
+			break;
+		if (len > 0 && recv(fd, cmd, len, MSG_WAITALL) != len)
+			break;
+		if (len < 2)
+			continue;
+		// node ID 255 addresses the aggregator, which has no config
+		int node = cmd[1];
+		if (node >= MAX_FAKE_NODES)
+			continue;
+		switch (cmd[0]) {
+		case COMMAND_ENV_CONFIG_WRITE:
+			// writes too short for their payload are ignored
+			if (len < 2 + 9)
+				break;
+			memcpy(g_env_config[node], &cmd[2], 9);
+			// fall through
+		case COMMAND_ENV_CONFIG_READ:
+			send_config(OPCODE_ENV_CONFIG, node, g_env_config[node], 9);
+			break;
+		case COMMAND_MOTION_CONFIG_WRITE:
+			if (len < 2 + 9)
+				break;
+			memcpy(g_motion_config[node], &cmd[2], 9);
+			// fall through
+		case COMMAND_MOTION_CONFIG_READ:
+			send_config(OPCODE_MOTION_CONFIG, node, g_motion_config[node], 9);
+			break;
+		case COMMAND_CONN_PARAM_WRITE:
+			if (len < 2 + 8)
+				break;
+			memcpy(g_conn_param[node], &cmd[2], 8);
+			// fall through
+		case COMMAND_CONN_PARAM_READ:
+			send_config(OPCODE_CONN_PARAM, node, g_conn_param[node], 8);
+			break;
+		case COMMAND_IO_WRITE:
+			if (len < 2 + 4)
+				break;
+			memcpy(g_io[node], &cmd[2], 4);
+			// fall through
+		case COMMAND_IO_READ:
+			send_config(OPCODE_EXTIO, node, g_io[node], 4);
+			break;
+		default:
+			break;
+		}
+	}
+	return 0;
+}
+
+static int listen_on(const char *address) {
+	int fd;
+	if (strncmp(address, SOCKET_PREFIX_UNIX, strlen(SOCKET_PREFIX_UNIX)) == 0) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, address + strlen(SOCKET_PREFIX_UNIX), sizeof(addr.sun_path) - 1);
+		unlink(addr.sun_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+			return -1;
+	}
+	else if (strncmp(address, SOCKET_PREFIX_TCP, strlen(SOCKET_PREFIX_TCP)) == 0) {
+		// tcp:<port> or tcp:<host>:<port>; always binds loopback
+		const char *port = strrchr(address, ':') + 1;
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(port));
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+			return -1;
+	}
+	else
+		return -1;
+	if (listen(fd, 1) != 0)
+		return -1;
+	return fd;
+}
+
+// stream synthetic data until the IOC disconnects
+static void stream(int nodes, int motion_hz) {
+	uint8_t resp[20];
+	long period_ns = 1000000000L / motion_hz;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (int node=0; node<nodes; node++) {
+		memset(resp, ' ', sizeof(resp));
+		resp[RESP_OPCODE] = OPCODE_CONNECT;
+		resp[1] = 0;
+		resp[RESP_ID] = node;
+		snprintf((char*)&resp[NAME_OFFSET], sizeof(resp) - NAME_OFFSET, "Node%d", node);
+		resp[NAME_OFFSET + strlen((char*)&resp[NAME_OFFSET])] = ' ';
+		if (send_frame(resp, sizeof(resp)) != 0)
+			return;
+	}
+
+	for (long tick=0; ; tick++) {
+		double t = (double)tick / motion_hz;
+		for (int node=0; node<nodes; node++) {
+			double phase = t + node;
+			memset(resp, 0, sizeof(resp));
+			resp[RESP_ID] = node;
+
+			resp[RESP_OPCODE] = OPCODE_QUATERNIONS;
+			put32(&resp[RESP_QUATERNIONS_W], (int32_t)(cos(phase / 2) * (1 << 30)));
+			put32(&resp[RESP_QUATERNIONS_X], (int32_t)(sin(phase / 2) * (1 << 30)));
+			put32(&resp[RESP_QUATERNIONS_Y], 0);
+			put32(&resp[RESP_QUATERNIONS_Z], 0);
+			if (send_frame(resp, 19) != 0)
+				return;
+
+			resp[RESP_OPCODE] = OPCODE_RAW_MOTION;
+			for (int i=0; i<9; i++)
+				put16(&resp[RESP_RAW_ACCEL_X + 2*i], (int16_t)(sin(phase + i) * 512));
+			if (send_frame(resp, 21) != 0)
+				return;
+
+			resp[RESP_OPCODE] = OPCODE_EULER;
+			put32(&resp[RESP_EULER_ROLL], (int32_t)(fmod(phase * 10, 360) * (1 << 16)));
+			put32(&resp[RESP_EULER_PITCH], 0);
+			put32(&resp[RESP_EULER_YAW], 0);
+			if (send_frame(resp, 15) != 0)
+				return;
+
+			resp[RESP_OPCODE] = OPCODE_HEADING;
+			put32(&resp[RESP_HEADING_VAL], (int32_t)(fmod(phase * 10, 360) * (1 << 16)));
+			if (send_frame(resp, 7) != 0)
+				return;
+
+			// environment data once per second
+			if (tick % motion_hz == 0) {
+				memset(resp, 0, sizeof(resp));
+				resp[RESP_ID] = node;
+				resp[RESP_OPCODE] = OPCODE_TEMPERATURE;
+				resp[RESP_TEMPERATURE_INT] = 20 + node % 5;
+				resp[RESP_TEMPERATURE_DEC] = tick % 100;
+				send_frame(resp, 5);
+				resp[RESP_OPCODE] = OPCODE_PRESSURE;
+				put32(&resp[RESP_PRESSURE_INT], 1013);
+				resp[RESP_PRESSURE_DEC] = 25;
+				send_frame(resp, 8);
+				resp[RESP_OPCODE] = OPCODE_HUMIDITY;
+				resp[RESP_HUMIDITY_VAL] = 40;
+				send_frame(resp, 4);
+				resp[RESP_OPCODE] = OPCODE_GAS;
+				put16(&resp[RESP_GAS_CO2], 400);
+				put16(&resp[RESP_GAS_TVOC], 10);
+				send_frame(resp, 7);
+				resp[RESP_OPCODE] = OPCODE_BATTERY;
+				resp[RESP_BATTERY_LEVEL] = 90;
+				send_frame(resp, 4);
+				resp[RESP_OPCODE] = OPCODE_RSSI;
+				resp[RESP_RSSI_VAL] = (uint8_t)(-50);
+				if (send_frame(resp, 4) != 0)
+					return;
+			}
+		}
+
+		next.tv_nsec += period_ns;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+}
+
+int main(int argc, const char *argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s <unix:path|tcp:port> [nodes] [motion Hz]\n", argv[0]);
+		return 1;
+	}
+	int nodes = (argc > 2) ? atoi(argv[2]) : 4;
+	int motion_hz = (argc > 3) ? atoi(argv[3]) : 10;
+	if (nodes < 1 || nodes > MAX_FAKE_NODES || motion_hz < 1) {
+		printf("Invalid node count or motion rate\n");
+		return 1;
+	}
+
+	int server = listen_on(argv[1]);
+	if (server < 0) {
+		printf("Failed to listen on %s\n", argv[1]);
+		return 1;
+	}
+	while (1) {
+		printf("Waiting for IOC on %s...\n", argv[1]);
+		g_fd = accept(server, NULL, NULL);
+		if (g_fd < 0)
+			continue;
+		printf("IOC connected. Streaming %d nodes at %d Hz\n", nodes, motion_hz);
+		pthread_t reader;
+		pthread_create(&reader, NULL, command_reader, NULL);
+		stream(nodes, motion_hz);
+		shutdown(g_fd, SHUT_RDWR);
+		pthread_join(reader, NULL);
+		close(g_fd);
+		printf("IOC disconnected.\n");
+	}
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <math.h>
+
+#include <iocsh.h>
+#include <epicsExport.h>
+
+#include "thingy_shared.h"
+#include "thingy_aggregator.h"
+#include "thingy_filter.h"
+
+// set to 0 in st.cmd to publish every value, changed or not
+int thingyChangeFilter = 1;
+epicsExportAddress(int, thingyChangeFilter);
+
+typedef struct {
+	// change must exceed both to be published
+	float absolute;
+	// fraction of the last value
+	float relative;
+} Deadband;
+
+// indexed by PV ID
+static Deadband g_deadbands[NUM_PV_IDS];
+
+void filter_attach(aSubRecord *pv, float *last) {
+	// NAN compares unequal to everything, so the first value is always published
+	*last = NAN;
+	pv->dpvt = last;
+}
+
+int value_changed(aSubRecord *pv, int pv_id, float val) {
+	float *last = pv->dpvt;
+	if (!thingyChangeFilter || last == 0 || !g_ioc_started)
+		return 1;
+	float delta = fabsf(val - *last);
+	if (pv_id >= 0 && pv_id < NUM_PV_IDS) {
+		const Deadband *db = &g_deadbands[pv_id];
+		if (delta <= db->absolute || delta <= db->relative * fabsf(*last))
+			return 0;
+	}
+	else if (delta == 0) {
+		return 0;
+	}
+	*last = val;
+	return 1;
+}
+
+/*
+ *	iocsh commands
+ */
+
+// deadband of all PVs with given PV ID (see ID_* in thingy_aggregator.h)
+static const iocshArg deadbandArg0 = {"PV ID", iocshArgInt};
+static const iocshArg deadbandArg1 = {"absolute", iocshArgDouble};
+static const iocshArg deadbandArg2 = {"relative", iocshArgDouble};
+static const iocshArg * const deadbandArgs[] = {&deadbandArg0, &deadbandArg1, &deadbandArg2};
+static const iocshFuncDef deadbandDef = {"thingyDeadband", 3, deadbandArgs};
+static void deadbandCallFunc(const iocshArgBuf *args) {
+	int pv_id = args[0].ival;
+	if (pv_id < 0 || pv_id >= NUM_PV_IDS || args[1].dval < 0 || args[2].dval < 0) {
+		printf("Usage: thingyDeadband <PV ID 0-%d> <absolute> <relative>\n", NUM_PV_IDS - 1);
+		return;
+	}
+	g_deadbands[pv_id].absolute = args[1].dval;
+	g_deadbands[pv_id].relative = args[2].dval;
+}
+
+static void thingyFilterRegister(void) {
+	iocshRegister(&deadbandDef, deadbandCallFunc);
+}
+
+epicsExportRegistrar(thingyFilterRegister);
@@ -0,0 +1,20 @@
+#ifndef THINGY_FILTER_H
+#define THINGY_FILTER_H
+
+#include <aSubRecord.h>
+
+// Value-change filter in front of record processing.
+// Each registered record keeps the last value published to it (its DPVT points
+// at the slot; aSub records have no device support to claim it). A value is only
+// published if it differs from the last one by more than the deadband of its PV ID,
+// set with thingyDeadband(); by default any change is published.
+// Disable with thingyChangeFilter=0 in st.cmd.
+
+// bind record to its last-published slot, initially empty
+void filter_attach(aSubRecord*, float*);
+
+// returns 1 if value is to be published to the record and remembers it, 0 if unchanged
+// values are never filtered before iocInit, as they are not scanned then
+int value_changed(aSubRecord*, int, float);
+
+#endif
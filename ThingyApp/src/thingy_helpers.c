@@ -19,78 +19,46 @@
 #include <epicsExport.h>
 #include <epicsTime.h>
 #include <callback.h>
-
-#include <glib.h>
-#include "gattlib.h"
+#include <dbLock.h>
+#include <stdatomic.h>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
 
 #include "thingy_shared.h"
 #include "thingy_aggregator.h"
 #include "thingy_helpers.h"
+#include "thingy_commands.h"
+#include "thingy_stats.h"
+#include "thingy_node_ids.h"
+#include "thingy_filter.h"
+#include "thingy_config_cache.h"
 
 static void print_resp(uint8_t*, size_t);
 
-// taken from gattlib; convert string to 128 bit uint
-static uint128_t str_to_128t(const char *string) {
-	uint32_t data0, data4;
-	uint16_t data1, data2, data3, data5;
-	uint128_t u128;
-	uint8_t *val = (uint8_t *) &u128;
-
-	if(sscanf(string, "%08x-%04hx-%04hx-%04hx-%08x%04hx",
-				&data0, &data1, &data2,
-				&data3, &data4, &data5) != 6) {
-		printf("Parse of UUID %s failed\n", string);
-		memset(&u128, 0, sizeof(uint128_t));
-		return u128;
-	}
-
-	data0 = htonl(data0);
-	data1 = htons(data1);
-	data2 = htons(data2);
-	data3 = htons(data3);
-	data4 = htonl(data4);
-	data5 = htons(data5);
-
-	memcpy(&val[0], &data0, 4);
-	memcpy(&val[4], &data1, 2);
-	memcpy(&val[6], &data2, 2);
-	memcpy(&val[8], &data3, 2);
-	memcpy(&val[10], &data4, 4);
-	memcpy(&val[14], &data5, 2);
-
-	return u128;
-}
-
-// construct a 128 bit UUID object from string
-uuid_t aggregator_UUID(const char *str) {
-	uint128_t uuid_val = str_to_128t(str);
-	uuid_t uuid = {.type=SDP_UUID128, .value.uuid128=uuid_val};
-	return uuid;
-}
-
 // get value from read/write PVs 
-// these PVs store value in INPC field
-static float get_writer_pv_value(int node_id, int pv_id) {
-	aSubRecord *pv = get_pv(node_id, pv_id);
-	if (pv != 0) {
-		scanOnce(pv);
-		// wait for scan to complete
-		usleep(500);
-		float c;
-		memcpy(&c, pv->c, sizeof(float));
-		//printf("%.2f\n", c);
-		return c;
-	}
-	else
+// these PVs link their setpoint through INPC, which is read directly
+// without waiting for the record to be scanned
+float get_writer_pv_value(Aggregator *agg, int node_id, int pv_id) {
+	aSubRecord *pv = get_pv(agg, node_id, pv_id);
+	if (pv == 0)
+		return -1;
+	float c;
+	dbScanLock((dbCommon*)pv);
+	long status = dbGetLink(&pv->inpc, DBR_FLOAT, &c, 0, 0);
+	dbScanUnlock((dbCommon*)pv);
+	if (status != 0)
 		return -1;
+	//printf("%.2f\n", c);
+	return c;
 }
 
 // toggle digital pin for node
 // toggled_pins = logical OR of pins to toggle
-void toggle_io_helper(int node_id, int toggled_pins) {
-	#ifdef USE_CUSTOM_IDS
-		node_id = get_actual_node_id(node_id);
-	#endif
+void toggle_io_helper(Aggregator *agg, int node_id, int toggled_pins) {
+	node_id = get_actual_node_id(agg, node_id);
+	if (node_id < 0)
+		return;
 	uint8_t command[6];
 	command[0] = COMMAND_IO_WRITE;
 	command[1] = node_id;
@@ -99,7 +67,7 @@ void toggle_io_helper(int node_id, int toggled_pins) {
 	int val;
 	int bit;
 	for (int i=0; i < 4; i++) {
-		val = get_writer_pv_value(node_id, ID_EXT0 + i);
+		val = get_writer_pv_value(agg, node_id, ID_EXT0 + i);
 		if (val == -1)
 			return;
 		bit = 1 << i;
@@ -109,24 +77,24 @@ void toggle_io_helper(int node_id, int toggled_pins) {
 		else
 			command[2 + i] = (val == 0) ? 0 : 255;
 	}
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
-	// wait for write to complete
-	usleep(500);
+	// cached config is stale until the confirming read comes back
+	config_cache_invalidate(agg, node_id, OPCODE_EXTIO);
+	send_command(agg, node_id, command, sizeof(command));
 	// read pins to confirm write
 	command[0] = COMMAND_IO_READ;
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
+	send_command(agg, node_id, command, sizeof(command));
 }
 
 // write environment config values to node
-void write_env_config_helper(int node_id) {
-	#ifdef USE_CUSTOM_IDS
-		node_id = get_actual_node_id(node_id);
-	#endif
-	uint16_t tempInterval = get_writer_pv_value(node_id, ID_TEMP_INTERVAL);
-	uint16_t pressureInterval = get_writer_pv_value(node_id, ID_PRESSURE_INTERVAL);
-	uint16_t humidInterval = get_writer_pv_value(node_id, ID_HUMID_INTERVAL);
+void write_env_config_helper(Aggregator *agg, int node_id) {
+	node_id = get_actual_node_id(agg, node_id);
+	if (node_id < 0)
+		return;
+	uint16_t tempInterval = get_writer_pv_value(agg, node_id, ID_TEMP_INTERVAL);
+	uint16_t pressureInterval = get_writer_pv_value(agg, node_id, ID_PRESSURE_INTERVAL);
+	uint16_t humidInterval = get_writer_pv_value(agg, node_id, ID_HUMID_INTERVAL);
 	uint16_t colorInterval = 60000;
-	uint8_t gasMode = get_writer_pv_value(node_id, ID_GAS_MODE);
+	uint8_t gasMode = get_writer_pv_value(agg, node_id, ID_GAS_MODE);
 	//printf("write env config: %d %d %d %d\n", tempInterval, pressureInterval, humidInterval, gasMode);
 	uint8_t command[14];
 	command[0] = COMMAND_ENV_CONFIG_WRITE;
@@ -144,24 +112,23 @@ void write_env_config_helper(int node_id) {
 	command[11] = 0;
 	command[12] = 0;
 	command[13] = 0;
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
-	// wait for write to complete
-	usleep(500);
+	config_cache_invalidate(agg, node_id, OPCODE_ENV_CONFIG);
+	send_command(agg, node_id, command, sizeof(command));
 	// read values again to confirm write
 	command[0] = COMMAND_ENV_CONFIG_READ;
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
+	send_command(agg, node_id, command, sizeof(command));
 }
 
 // write motion config values to node
-void write_motion_config_helper(int node_id) {
-	#ifdef USE_CUSTOM_IDS
-		node_id = get_actual_node_id(node_id);
-	#endif
-	uint16_t steps = get_writer_pv_value(node_id, ID_STEP_INTERVAL);
-	uint16_t tempComp = get_writer_pv_value(node_id, ID_TEMP_COMP_INTERVAL);
-	uint16_t magComp = get_writer_pv_value(node_id, ID_MAG_COMP_INTERVAL);
-	uint16_t freq = get_writer_pv_value(node_id, ID_MOTION_FREQ);
-	uint8_t wake = get_writer_pv_value(node_id, ID_WAKE);
+void write_motion_config_helper(Aggregator *agg, int node_id) {
+	node_id = get_actual_node_id(agg, node_id);
+	if (node_id < 0)
+		return;
+	uint16_t steps = get_writer_pv_value(agg, node_id, ID_STEP_INTERVAL);
+	uint16_t tempComp = get_writer_pv_value(agg, node_id, ID_TEMP_COMP_INTERVAL);
+	uint16_t magComp = get_writer_pv_value(agg, node_id, ID_MAG_COMP_INTERVAL);
+	uint16_t freq = get_writer_pv_value(agg, node_id, ID_MOTION_FREQ);
+	uint8_t wake = get_writer_pv_value(agg, node_id, ID_WAKE);
 	//printf("write motion config: %d %d %d %d %d\n", steps, tempComp, magComp, freq, wake);
 	uint8_t command[11];
 	command[0] = COMMAND_MOTION_CONFIG_WRITE;
@@ -175,23 +142,22 @@ void write_motion_config_helper(int node_id) {
 	command[8] = freq & 0xFF;
 	command[9] = freq >> 8;
 	command[10] = wake;
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
-	// wait for write to complete
-	usleep(500);
+	config_cache_invalidate(agg, node_id, OPCODE_MOTION_CONFIG);
+	send_command(agg, node_id, command, sizeof(command));
 	// read values again to confirm write
 	command[0] = COMMAND_MOTION_CONFIG_READ;
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
+	send_command(agg, node_id, command, sizeof(command));
 }
 
 // write conn param values to node
-void write_conn_param_helper(int node_id) {
-	#ifdef USE_CUSTOM_IDS
-		node_id = get_actual_node_id(node_id);
-	#endif
-	uint16_t min = (uint16_t) (get_writer_pv_value(node_id, ID_CONN_MIN_INTERVAL) / 1.25);
-	uint16_t max = (uint16_t) (get_writer_pv_value(node_id, ID_CONN_MAX_INTERVAL) / 1.25);
-	uint16_t latency = get_writer_pv_value(node_id, ID_CONN_LATENCY);
-	uint16_t timeout = (uint16_t) (get_writer_pv_value(node_id, ID_CONN_TIMEOUT) / 10);
+void write_conn_param_helper(Aggregator *agg, int node_id) {
+	node_id = get_actual_node_id(agg, node_id);
+	if (node_id < 0)
+		return;
+	uint16_t min = (uint16_t) (get_writer_pv_value(agg, node_id, ID_CONN_MIN_INTERVAL) / 1.25);
+	uint16_t max = (uint16_t) (get_writer_pv_value(agg, node_id, ID_CONN_MAX_INTERVAL) / 1.25);
+	uint16_t latency = get_writer_pv_value(agg, node_id, ID_CONN_LATENCY);
+	uint16_t timeout = (uint16_t) (get_writer_pv_value(agg, node_id, ID_CONN_TIMEOUT) / 10);
 	uint8_t command[10];
 	command[0] = COMMAND_CONN_PARAM_WRITE;
 	command[1] = node_id;
@@ -203,373 +169,641 @@ void write_conn_param_helper(int node_id) {
 	command[7] = latency >> 8;
 	command[8] = timeout & 0xFF;
 	command[9] = timeout >> 8;
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
-	usleep(500);
+	config_cache_invalidate(agg, node_id, OPCODE_CONN_PARAM);
+	send_command(agg, node_id, command, sizeof(command));
 	command[0] = COMMAND_CONN_PARAM_READ;
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
+	send_command(agg, node_id, command, sizeof(command));
 }	
 
 /*
  *	helper functions to parse response from node according to opcode and save to corresponding PVs
  */
 
-static void parse_connect(uint8_t *resp, size_t len) {
+static void parse_connect(Aggregator *agg, uint8_t *resp, size_t len, const epicsTimeStamp *stamp) {
 	int curr_id = resp[RESP_ID];
 	int valid = 1;
+	if (curr_id >= agg->max_nodes) {
+		printf("WARNING: Node %d exceeds node count %d of aggregator %d. Ignoring connection\n", curr_id, agg->max_nodes, agg->id);
+		return;
+	}
 
-	#ifdef USE_CUSTOM_IDS
-		// get Bluetooth name of node
-		char name[MAX_NAME_LENGTH];
-		memset(name, 0, MAX_NAME_LENGTH);
-		int name_length = 0;
-		for (name_length; name_length < MAX_NAME_LENGTH; name_length++)
-			if (resp[RESP_CONNECT_NAME + name_length] == 32)
-				break;
-		memcpy(name, &(resp[RESP_CONNECT_NAME]), name_length);
-
-		// check if name matches custom node name
-		if (strncmp(name, CUSTOM_NODE_NAME, strlen(CUSTOM_NODE_NAME)) == 0) {
-			char custom_id_buf[5];
-			memset(custom_id_buf, 0, sizeof(custom_id_buf));
-			memcpy(custom_id_buf, &(name[strlen(CUSTOM_NODE_NAME)]), name_length - strlen(CUSTOM_NODE_NAME));
-			int custom_id = strtol(custom_id_buf, NULL, 10);
-			if (g_custom_node_ids[curr_id] == -1) {
-				printf("Assigned custom node ID %d to device %s (actual ID %d)\n", custom_id, name, curr_id);
-				g_custom_node_ids[curr_id] = custom_id;
-			}
-			else {
-				printf("WARNING: Can not assign node ID %d to device %s: Already in use\n", custom_id, name);
-				valid = 0;
-			}
-		}
-		else {
-			if (g_custom_node_ids[curr_id] == -1) {
-				printf("Assigned node ID %d to device %s\n", curr_id, name);
-				g_custom_node_ids[curr_id] = curr_id;
-			}
-			else {
-				printf("WARNING: Can not assign node ID %d to device %s: Already in use\n", curr_id, name);
-				valid = 0;
-			}
-		}
-	#endif
+	if (g_custom_ids)
+		valid = node_id_connect(agg, curr_id, resp, len) == 0;
 
+	// whatever was cached for this node ID may be of another device
+	config_cache_invalidate(agg, curr_id, -1);
+	atomic_store(&agg->nodes[curr_id].streams_off, 0);
 	if (valid) {
-		set_connection(curr_id, CONNECTED);
-		#ifndef USE_CUSTOM_IDS
+		set_connection(agg, curr_id, CONNECTED);
+		if (!g_custom_ids)
 			printf("Connected node %d\n", curr_id);
-		#endif
 	}
 }
 
-static void parse_disconnect(uint8_t *resp, size_t len) {
+static void parse_disconnect(Aggregator *agg, uint8_t *resp, size_t len, const epicsTimeStamp *stamp) {
 	int node_id = resp[RESP_ID];
 	printf("Node %d disconnected\n", node_id);
-	disconnect_node(node_id);
-	#ifdef USE_CUSTOM_IDS
-		g_custom_node_ids[node_id] = -1;
-	#endif
+	if (node_id >= agg->max_nodes)
+		return;
+	disconnect_node(agg, node_id);
+	// the aggregator may give this node ID to the next device that connects
+	if (g_custom_ids)
+		node_id_release(agg, node_id);
 }
 
-static void parse_button(uint8_t *resp, size_t len) {
+// air quality string shown alongside the eCO2/TVOC values
+static void parse_gas(Aggregator *agg, uint8_t *resp, size_t len, const epicsTimeStamp *stamp) {
 	int node_id = resp[RESP_ID];
-	aSubRecord *button_pv = get_pv(node_id, ID_BUTTON);
+	aSubRecord *gas_pv = get_pv(agg, node_id, ID_GAS);
 
-	if (button_pv != 0)
-		set_pv(button_pv, resp[RESP_BUTTON_STATE]);
+	if (gas_pv != 0 && g_ioc_started) {
+		int i = RESP_GAS_CO2;
+		uint16_t co2 = (resp[i]) | (resp[i+1] << 8);
+		i = RESP_GAS_TVOC;
+		uint16_t tvoc = (resp[i]) | (resp[i+1] << 8);
+		char buf[40];
+		memset(buf, 0, sizeof(buf));
+		snprintf(buf, sizeof(buf), "%u eCO2 ppm\n%u TVOC ppb", (unsigned int)co2, (unsigned int)tvoc);
+		strncpy(gas_pv->vala, buf, sizeof(buf));
+		scan_pv(gas_pv, stamp);
+	}
 }
 
-static void parse_battery(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *battery_pv = get_pv(node_id, ID_BATTERY);
+/*
+ *	batched publishing of all values decoded from one response
+ *	values are written and their records processed in one callback, under one lock and with one timestamp
+ */
 
-	if (battery_pv != 0)
-		set_pv(battery_pv, resp[RESP_BATTERY_LEVEL]);
-}
+// max fields decoded from one response
+#define MAX_FIELDS 9
+// number of batches which may wait for the callback thread at once
+#define BATCH_POOL_SIZE 256
 
-static void parse_rssi(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *rssi_pv = get_pv(node_id, ID_RSSI);
-	int8_t rssi = resp[RESP_RSSI_VAL];
+// set to 0 in st.cmd to publish every value with its own scanOnce()
+int thingyBatchPublish = 1;
+epicsExportAddress(int, thingyBatchPublish);
 
-	if (rssi_pv != 0)
-		set_pv(rssi_pv, rssi);
-}
+typedef struct {
+	CALLBACK callback;
+	atomic_int in_use;
+	Aggregator *agg;
+	int node_id;
+	int opcode;
+	int count;
+	aSubRecord *pvs[MAX_FIELDS];
+	float vals[MAX_FIELDS];
+	epicsTimeStamp time;
+} PublishBatch;
 
-static void parse_temperature(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *temp_pv = get_pv(node_id, ID_TEMPERATURE);
+// lock set for the records of each node/opcode, created on first use by the callback thread
+typedef struct {
+	dbLocker *locker;
+	// records the lock set was made for; changes with the values the change filter lets through
+	// and if custom node IDs are reassigned
+	aSubRecord *pvs[MAX_FIELDS];
+	int count;
+} BatchLocker;
 
-	if (temp_pv != 0) {
-		int8_t integer = resp[RESP_TEMPERATURE_INT];
-		uint8_t decimal = resp[RESP_TEMPERATURE_DEC];
-		float temperature = integer + (float)(decimal / 100.0);
-		set_pv(temp_pv, temperature);
-	}
-}
+typedef struct MotionBlock MotionBlock;
 
-static void parse_pressure(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *pressure_pv = get_pv(node_id, ID_PRESSURE);
+// window of samples of one decimated stream
+typedef struct {
+	int count;
+	// sum, min or max of each field so far
+	float acc[MAX_FIELDS];
+} Decimator;
 
-	if (pressure_pv != 0) {
-		int i = RESP_PRESSURE_INT;
-		int32_t integer = (resp[i]) | (resp[i+1] << 8) | (resp[i+2] << 16) | (resp[i+3] << 24);
-		uint8_t decimal = resp[RESP_PRESSURE_DEC];
-		float pressure = integer + (float)(decimal / 100.0);
-		set_pv(pressure_pv, pressure);
-	}
-}
+// publishing state of one aggregator
+struct PublishState {
+	// batches are only taken by the aggregator's parser thread
+	PublishBatch batches[BATCH_POOL_SIZE];
+	unsigned next_batch;
+	// indexed [node_id * NUM_OPCODES + opcode]
+	BatchLocker *lockers;
+	// indexed [node_id * NUM_OPCODES + opcode]; blocks allocated on first sample
+	// of each node/opcode. Only used by the parser thread
+	MotionBlock **blocks;
+	// indexed [node_id * NUM_DECIMATED_STREAMS + stream]; only used by the parser thread
+	Decimator *decimators;
+	// receive-to-publish latency histogram, counts since last taken
+	atomic_uint latency_counts[LATENCY_BUCKETS];
+};
 
-static void parse_humidity(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *humid_pv = get_pv(node_id, ID_HUMIDITY);
+// count time from receiving a response to processing its records
+static void record_latency(struct PublishState *ps, const epicsTimeStamp *stamp) {
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	double ms = epicsTimeDiffInSeconds(&now, stamp) * 1000;
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS - 1 && ms >= (1u << bucket))
+		bucket++;
+	atomic_fetch_add_explicit(&ps->latency_counts[bucket], 1, memory_order_relaxed);
+}
 
-	if (humid_pv != 0)
-		set_pv(humid_pv, resp[RESP_HUMIDITY_VAL]);
+void take_publish_latency(Aggregator *agg, double *counts) {
+	for (int i=0; i<LATENCY_BUCKETS; i++)
+		counts[i] = atomic_exchange_explicit(&agg->publish->latency_counts[i], 0, memory_order_relaxed);
 }
 
-static void parse_gas(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *gas_pv = get_pv(node_id, ID_GAS);
-	aSubRecord *co_pv = get_pv(node_id, ID_CO2);
-	aSubRecord *tvoc_pv = get_pv(node_id, ID_TVOC);
+static void publish_batch_callback(CALLBACK *pcallback) {
+	PublishBatch *batch;
+	callbackGetUser(batch, pcallback);
 
-	if (gas_pv != 0 && g_ioc_started) {
-		int i = RESP_GAS_CO2;
-		uint16_t co2 = (resp[i]) | (resp[i+1] << 8);
-		if (co_pv != 0)
-			set_pv(co_pv, co2);
-		i = RESP_GAS_TVOC;
-		uint16_t tvoc = (resp[i]) | (resp[i+1] << 8);
-		if (tvoc_pv != 0)
-			set_pv(tvoc_pv, tvoc);
-		char buf[40];
-		memset(buf, 0, sizeof(buf));
-		snprintf(buf, sizeof(buf), "%u eCO2 ppm\n%u TVOC ppb", (unsigned int)co2, (unsigned int)tvoc);
-		strncpy(gas_pv->vala, buf, sizeof(buf));
-		scanOnce(gas_pv);
+	struct PublishState *ps = batch->agg->publish;
+	BatchLocker *bl = &ps->lockers[batch->node_id * NUM_OPCODES + batch->opcode];
+	if (bl->locker == 0 || bl->count != batch->count || memcmp(bl->pvs, batch->pvs, batch->count * sizeof(aSubRecord*)) != 0) {
+		if (bl->locker != 0)
+			dbLockerFree(bl->locker);
+		bl->locker = dbLockerAlloc((dbCommon**)batch->pvs, batch->count, 0);
+		memcpy(bl->pvs, batch->pvs, batch->count * sizeof(aSubRecord*));
+		bl->count = batch->count;
 	}
+	dbScanLockMany(bl->locker);
+	for (int i=0; i<batch->count; i++) {
+		aSubRecord *pv = batch->pvs[i];
+		memcpy(pv->vala, &batch->vals[i], sizeof(float));
+		pv->time = batch->time;
+		dbProcess((dbCommon*)pv);
+	}
+	dbScanUnlockMany(bl->locker);
+	record_latency(ps, &batch->time);
+	atomic_store_explicit(&batch->in_use, 0, memory_order_release);
 }
 
-static void parse_env_config(uint8_t *resp, size_t len) {
-	//print_resp(resp, len);
-	int node_id = resp[RESP_ID];
-	aSubRecord *temp_interval_pv = get_pv(node_id, ID_TEMP_INTERVAL);
-	aSubRecord *pressure_interval_pv = get_pv(node_id, ID_PRESSURE_INTERVAL);
-	aSubRecord *humid_interval_pv = get_pv(node_id, ID_HUMID_INTERVAL);
-	aSubRecord *gas_mode_pv = get_pv(node_id, ID_GAS_MODE);
-	uint16_t interval;
-	if (temp_interval_pv != 0) {
-		interval = (resp[3]) | (resp[4] << 8);
-		set_pv(temp_interval_pv, interval);
-		set_pv(temp_interval_pv, interval);
+// publish values with a scanOnce() each
+static void publish_pvs_unbatched(aSubRecord **pvs, float *vals, int count, const epicsTimeStamp *stamp) {
+	for (int i=0; i<count; i++) {
+		memcpy(pvs[i]->vala, &vals[i], sizeof(float));
+		scan_pv(pvs[i], stamp);
 	}
-	if (pressure_interval_pv != 0) {
-		interval = (resp[5]) | (resp[6] << 8);
-		set_pv(pressure_interval_pv, interval);
-		set_pv(pressure_interval_pv, interval);
-	}
-	if (humid_interval_pv != 0) {
-		interval = (resp[7]) | (resp[8] << 8);
-		set_pv(humid_interval_pv, interval);
-		set_pv(humid_interval_pv, interval);
+}
+
+// publish values decoded from one response of the given node/opcode
+// records are stamped with the time the response was received
+// only called from the parser thread
+static void publish_pvs(Aggregator *agg, int node_id, int opcode, aSubRecord **pvs, float *vals, int count, const epicsTimeStamp *stamp) {
+	if (count == 0)
+		return;
+	stats_add(&agg->stats, node_id, opcode, STAT_PUBLISHES, count);
+	struct PublishState *ps = agg->publish;
+	PublishBatch *batch = &ps->batches[ps->next_batch % BATCH_POOL_SIZE];
+	if (!thingyBatchPublish || !g_ioc_started || atomic_load_explicit(&batch->in_use, memory_order_acquire)) {
+		// unbatched, or callback thread is behind
+		publish_pvs_unbatched(pvs, vals, count, stamp);
+		return;
 	}
-	if (gas_mode_pv != 0) {
-		set_pv(gas_mode_pv, resp[11]);
-		set_pv(gas_mode_pv, resp[11]);
+	ps->next_batch++;
+
+	batch->agg = agg;
+	batch->node_id = node_id;
+	batch->opcode = opcode;
+	batch->count = count;
+	memcpy(batch->pvs, pvs, count * sizeof(aSubRecord*));
+	memcpy(batch->vals, vals, count * sizeof(float));
+	batch->time = *stamp;
+	atomic_store_explicit(&batch->in_use, 1, memory_order_relaxed);
+	callbackSetCallback(publish_batch_callback, &batch->callback);
+	callbackSetPriority(priorityMedium, &batch->callback);
+	callbackSetUser(batch, &batch->callback);
+	if (callbackRequest(&batch->callback) != 0) {
+		atomic_store_explicit(&batch->in_use, 0, memory_order_relaxed);
+		publish_pvs_unbatched(pvs, vals, count, stamp);
 	}
 }
 
-static void parse_quaternions(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *pvs[4];
-	pvs[0] = get_pv(node_id, ID_QUATERNION_W);
-	pvs[1] = get_pv(node_id, ID_QUATERNION_X);
-	pvs[2] = get_pv(node_id, ID_QUATERNION_Y);
-	pvs[3] = get_pv(node_id, ID_QUATERNION_Z);
-
-	for (int i=0; i<4; i++) {
-		if (pvs[i] != 0) {
-			int j = RESP_QUATERNIONS_W + (i * 4);
-			int32_t raw = (resp[j]) | (resp[j+1] << 8) | (resp[j+2] << 16) | (resp[j+3] << 24);
-			float x = ((float)(raw) / (float)(1 << 30)); // 2Q30 fixed point
-			set_pv(pvs[i], x);
-		}
+/*
+ *	block publishing of high-rate motion streams
+ *	samples are collected per node and stream and published as waveforms once a block is full
+ */
+
+// set in st.cmd to publish motion data in blocks of this many samples; 0 publishes every sample
+int thingyMotionBlock = 0;
+epicsExportAddress(int, thingyMotionBlock);
+
+struct MotionBlock {
+	int count;
+	// receive time of first sample; the block is published with it
+	epicsTimeStamp first_time;
+	double vals[MAX_FIELDS][MOTION_BLOCK_MAX];
+	// sample receive times, POSIX seconds
+	double times[MOTION_BLOCK_MAX];
+};
+
+// block PV of each motion opcode
+static const int g_block_pv_ids[NUM_OPCODES] = {
+	[OPCODE_QUATERNIONS] = ID_QUATERNION_BLOCK,
+	[OPCODE_RAW_MOTION] = ID_RAW_MOTION_BLOCK,
+	[OPCODE_EULER] = ID_EULER_BLOCK,
+	[OPCODE_HEADING] = ID_HEADING_BLOCK,
+};
+
+// write block to the block PV's arrays (one per field, then sample times) and process it
+static void publish_block(Aggregator *agg, int node_id, int opcode, aSubRecord *pv, MotionBlock *block, int num_fields) {
+	void **outs = &pv->vala;
+	epicsUInt32 *nova = &pv->nova;
+	epicsUInt32 *neva = &pv->neva;
+	dbScanLock((dbCommon*)pv);
+	for (int i=0; i<=num_fields; i++) {
+		double *src = (i < num_fields) ? block->vals[i] : block->times;
+		int count = (block->count < nova[i]) ? block->count : nova[i];
+		memcpy(outs[i], src, count * sizeof(double));
+		neva[i] = count;
 	}
+	pv->time = block->first_time;
+	dbProcess((dbCommon*)pv);
+	dbScanUnlock((dbCommon*)pv);
+	record_latency(agg->publish, &block->first_time);
+	stats_add(&agg->stats, node_id, opcode, STAT_PUBLISHES, 1);
+	block->count = 0;
 }
 
-static void parse_raw_motion(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *pvs[9];
-	pvs[0] = get_pv(node_id, ID_ACCEL_X); pvs[1] = get_pv(node_id, ID_ACCEL_Y); pvs[2] = get_pv(node_id, ID_ACCEL_Z);
-	pvs[3] = get_pv(node_id, ID_GYRO_X); pvs[4] = get_pv(node_id, ID_GYRO_Y); pvs[5] = get_pv(node_id, ID_GYRO_Z);
-	pvs[6] = get_pv(node_id, ID_COMPASS_X); pvs[7] = get_pv(node_id, ID_COMPASS_Y); pvs[8] = get_pv(node_id, ID_COMPASS_Z);
-	for (int i=0; i<9; i++) {
-		if (pvs[i] != 0) {
-			int j = RESP_RAW_ACCEL_X + (i * 2);
-			int16_t raw = (resp[j]) | (resp[j+1] << 8);
-			float x;
-			if (i <= 2) // acceleration
-				x = ((float)(raw) / (float)(1 << 10)); // 6Q10 fixed point
-			else if (i <= 5) // gyroscope
-				x = ((float)(raw) / (float)(1 << 5)); // 11Q5 fixed point
-			else // compass
-				x = ((float)(raw) / (float)(1 << 4)); // 12Q4 fixed point
-			set_pv(pvs[i], x);
-		}
+// add decoded motion sample to its block, publishing the block once full
+// returns 1 if the sample is held in the block, 0 if scalar PVs should be published
+// so scalar PVs still follow the stream, at one update per block
+static int hold_block_sample(Aggregator *agg, int node_id, int opcode, float *vals, int count, const epicsTimeStamp *stamp) {
+	if (thingyMotionBlock <= 0 || !g_ioc_started || node_id >= agg->max_nodes || g_block_pv_ids[opcode] == 0)
+		return 0;
+	aSubRecord *pv = get_pv(agg, node_id, g_block_pv_ids[opcode]);
+	if (pv == 0)
+		return 0;
+	MotionBlock **slot = &agg->publish->blocks[node_id * NUM_OPCODES + opcode];
+	MotionBlock *block = *slot;
+	if (block == 0) {
+		block = calloc(1, sizeof(MotionBlock));
+		if (block == 0)
+			return 0;
+		*slot = block;
 	}
+
+	if (block->count == 0)
+		block->first_time = *stamp;
+	block->times[block->count] = stamp->secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH + stamp->nsec / 1e9;
+	for (int i=0; i<count; i++)
+		block->vals[i][block->count] = vals[i];
+	block->count++;
+
+	int size = (thingyMotionBlock < MOTION_BLOCK_MAX) ? thingyMotionBlock : MOTION_BLOCK_MAX;
+	if (block->count < size)
+		return 1;
+	publish_block(agg, node_id, opcode, pv, block, count);
+	return 0;
 }
 
-static void parse_euler(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *pvs[3];
-	pvs[0] = get_pv(node_id, ID_ROLL);
-	pvs[1] = get_pv(node_id, ID_PITCH);
-	pvs[2] = get_pv(node_id, ID_YAW);
-	for (int i=0; i<3; i++) {
-		if (pvs[i] != 0) {
-			int j = RESP_EULER_ROLL + (i * 4);
-			int32_t raw = (resp[j]) | (resp[j+1] << 8) | (resp[j+2] << 16) | (resp[j+3] << 24);
-			float x = ((float)(raw) / (float)(1 << 16)); // 16Q16 fixed point
-			set_pv(pvs[i], x);
+/*
+ *	decimation of motion streams
+ *	samples are folded into a window per node and stream, and one mean, min or max is published per window
+ *	capture and replay still see every sample
+ */
+
+// decimation PV of each decimated opcode; its stream is the offset from ID_QUATERNION_DECIMATION
+static const int g_decimation_pv_ids[NUM_OPCODES] = {
+	[OPCODE_QUATERNIONS] = ID_QUATERNION_DECIMATION,
+	[OPCODE_RAW_MOTION] = ID_RAW_MOTION_DECIMATION,
+	[OPCODE_EULER] = ID_EULER_DECIMATION,
+};
+
+// fold decoded sample into its window
+// returns 1 while the window is filling, 0 once vals holds the decimated sample to publish
+static int decimate_sample(Aggregator *agg, int node_id, int opcode, float *vals, int count) {
+	if (g_decimation_pv_ids[opcode] == 0 || node_id >= agg->max_nodes)
+		return 0;
+	int stream = g_decimation_pv_ids[opcode] - ID_QUATERNION_DECIMATION;
+	// decimation is set on the node's PVs, so follows custom node IDs
+	int row = (g_custom_ids && g_ioc_started) ? agg->nodes[node_id].custom_id : node_id;
+	if (row < 0)
+		return 0;
+	int factor = agg->nodes[row].decimation[stream];
+	if (factor <= 1)
+		return 0;
+	int mode = agg->nodes[row].decimation_mode[stream];
+	Decimator *d = &agg->publish->decimators[node_id * NUM_DECIMATED_STREAMS + stream];
+	if (d->count == 0) {
+		memcpy(d->acc, vals, count * sizeof(float));
+	}
+	else {
+		for (int i=0; i<count; i++) {
+			if (mode == DECIMATE_MIN)
+				d->acc[i] = fminf(d->acc[i], vals[i]);
+			else if (mode == DECIMATE_MAX)
+				d->acc[i] = fmaxf(d->acc[i], vals[i]);
+			else
+				d->acc[i] += vals[i];
 		}
 	}
+	d->count++;
+	// a window is cut short if the factor is lowered while it fills
+	if (d->count < factor)
+		return 1;
+	for (int i=0; i<count; i++)
+		vals[i] = (mode == DECIMATE_MIN || mode == DECIMATE_MAX) ? d->acc[i] : d->acc[i] / d->count;
+	d->count = 0;
+	return 0;
 }
 
-static void parse_heading(uint8_t *resp, size_t len) {
-	int node_id = resp[RESP_ID];
-	aSubRecord *heading_pv = get_pv(node_id, ID_HEADING);
-	if (heading_pv != 0) {
-		int i = RESP_HEADING_VAL;
-		int32_t raw = (resp[i]) | (resp[i+1] << 8) | (resp[i+2] << 16) | (resp[i+3] << 24);
-		float x = ((float)(raw) / (float)(1 << 16)); // 16Q16 fixed point
-		set_pv(heading_pv, x);
-	}
+/*
+ *	descriptor table for decoding responses
+ *	each opcode lists the fields of its payload; parse_resp() decodes them generically
+ */
+
+// pv_id of a field whose value is added to the previous field instead of published
+// eg. the decimal part of temperature/pressure
+#define FIELD_ADD -1
+
+typedef struct {
+	uint8_t offset;		// byte offset in payload
+	uint8_t width;		// 1, 2 or 4 bytes, little endian
+	uint8_t is_signed;
+	float factor;		// Q-format scale combined with unit conversion
+	int pv_id;			// PV to publish to, or FIELD_ADD
+} FieldDesc;
+
+typedef struct {
+	uint8_t min_len;	// shorter responses are rejected
+	uint8_t num_fields;
+	FieldDesc fields[MAX_FIELDS];
+	// optional special handling, called after fields are published
+	void (*handler)(Aggregator*, uint8_t*, size_t, const epicsTimeStamp*);
+} OpcodeDesc;
+
+// field with fixed point format Q(frac) multiplied by scale
+#define FIELD(offset, width, is_signed, frac, scale, pv_id) { offset, width, is_signed, (float)(scale) / (float)(1u << (frac)), pv_id }
+#define U8(offset, pv_id) FIELD(offset, 1, 0, 0, 1, pv_id)
+#define U16(offset, pv_id) FIELD(offset, 2, 0, 0, 1, pv_id)
+
+static const OpcodeDesc g_opcodes[NUM_OPCODES] = {
+	[OPCODE_CONNECT] = { RESP_ID + 1, 0, {}, parse_connect },
+	[OPCODE_DISCONNECT] = { RESP_ID + 1, 0, {}, parse_disconnect },
+	[OPCODE_BUTTON] = { RESP_BUTTON_STATE + 1, 1, { U8(RESP_BUTTON_STATE, ID_BUTTON) } },
+	[OPCODE_BATTERY] = { RESP_BATTERY_LEVEL + 1, 1, { U8(RESP_BATTERY_LEVEL, ID_BATTERY) } },
+	[OPCODE_RSSI] = { RESP_RSSI_VAL + 1, 1, { FIELD(RESP_RSSI_VAL, 1, 1, 0, 1, ID_RSSI) } },
+	[OPCODE_TEMPERATURE] = { RESP_TEMPERATURE_DEC + 1, 2, {
+		FIELD(RESP_TEMPERATURE_INT, 1, 1, 0, 1, ID_TEMPERATURE),
+		FIELD(RESP_TEMPERATURE_DEC, 1, 0, 0, 0.01, FIELD_ADD) } },
+	[OPCODE_PRESSURE] = { RESP_PRESSURE_DEC + 1, 2, {
+		FIELD(RESP_PRESSURE_INT, 4, 1, 0, 1, ID_PRESSURE),
+		FIELD(RESP_PRESSURE_DEC, 1, 0, 0, 0.01, FIELD_ADD) } },
+	[OPCODE_HUMIDITY] = { RESP_HUMIDITY_VAL + 1, 1, { U8(RESP_HUMIDITY_VAL, ID_HUMIDITY) } },
+	[OPCODE_GAS] = { RESP_GAS_TVOC + 2, 2, {
+		U16(RESP_GAS_CO2, ID_CO2),
+		U16(RESP_GAS_TVOC, ID_TVOC) }, parse_gas },
+	[OPCODE_ENV_CONFIG] = { 12, 4, {
+		U16(3, ID_TEMP_INTERVAL),
+		U16(5, ID_PRESSURE_INTERVAL),
+		U16(7, ID_HUMID_INTERVAL),
+		U8(11, ID_GAS_MODE) } },
+	[OPCODE_QUATERNIONS] = { RESP_QUATERNIONS_Z + 4, 4, {
+		FIELD(RESP_QUATERNIONS_W, 4, 1, 30, 1, ID_QUATERNION_W), // 2Q30 fixed point
+		FIELD(RESP_QUATERNIONS_X, 4, 1, 30, 1, ID_QUATERNION_X),
+		FIELD(RESP_QUATERNIONS_Y, 4, 1, 30, 1, ID_QUATERNION_Y),
+		FIELD(RESP_QUATERNIONS_Z, 4, 1, 30, 1, ID_QUATERNION_Z) } },
+	[OPCODE_RAW_MOTION] = { RESP_RAW_COMPASS_Z + 2, 9, {
+		FIELD(RESP_RAW_ACCEL_X, 2, 1, 10, 1, ID_ACCEL_X), // 6Q10 fixed point
+		FIELD(RESP_RAW_ACCEL_Y, 2, 1, 10, 1, ID_ACCEL_Y),
+		FIELD(RESP_RAW_ACCEL_Z, 2, 1, 10, 1, ID_ACCEL_Z),
+		FIELD(RESP_RAW_GYRO_X, 2, 1, 5, 1, ID_GYRO_X), // 11Q5 fixed point
+		FIELD(RESP_RAW_GYRO_Y, 2, 1, 5, 1, ID_GYRO_Y),
+		FIELD(RESP_RAW_GYRO_Z, 2, 1, 5, 1, ID_GYRO_Z),
+		FIELD(RESP_RAW_COMPASS_X, 2, 1, 4, 1, ID_COMPASS_X), // 12Q4 fixed point
+		FIELD(RESP_RAW_COMPASS_Y, 2, 1, 4, 1, ID_COMPASS_Y),
+		FIELD(RESP_RAW_COMPASS_Z, 2, 1, 4, 1, ID_COMPASS_Z) } },
+	[OPCODE_EULER] = { RESP_EULER_YAW + 4, 3, {
+		FIELD(RESP_EULER_ROLL, 4, 1, 16, 1, ID_ROLL), // 16Q16 fixed point
+		FIELD(RESP_EULER_PITCH, 4, 1, 16, 1, ID_PITCH),
+		FIELD(RESP_EULER_YAW, 4, 1, 16, 1, ID_YAW) } },
+	[OPCODE_HEADING] = { RESP_HEADING_VAL + 4, 1, {
+		FIELD(RESP_HEADING_VAL, 4, 1, 16, 1, ID_HEADING) } }, // 16Q16 fixed point
+	[OPCODE_MOTION_CONFIG] = { 12, 5, {
+		U16(3, ID_STEP_INTERVAL),
+		U16(5, ID_TEMP_COMP_INTERVAL),
+		U16(7, ID_MAG_COMP_INTERVAL),
+		U16(9, ID_MOTION_FREQ),
+		U8(11, ID_WAKE) } },
+	[OPCODE_CONN_PARAM] = { 11, 4, {
+		FIELD(3, 2, 0, 0, 1.25, ID_CONN_MIN_INTERVAL), // 1.25 ms units
+		FIELD(5, 2, 0, 0, 1.25, ID_CONN_MAX_INTERVAL),
+		U16(7, ID_CONN_LATENCY),
+		FIELD(9, 2, 0, 0, 10, ID_CONN_TIMEOUT) } }, // 10 ms units
+	[OPCODE_EXTIO] = { 7, 4, {
+		U8(3, ID_EXT0),
+		U8(4, ID_EXT1),
+		U8(5, ID_EXT2),
+		U8(6, ID_EXT3) } },
+};
+
+// decode a little endian field according to its descriptor
+static inline float decode_field(const uint8_t *resp, const FieldDesc *field) {
+	const uint8_t *p = &resp[field->offset];
+	uint32_t raw = p[0];
+	if (field->width > 1)
+		raw |= (p[1] << 8);
+	if (field->width > 2)
+		raw |= (p[2] << 16) | ((uint32_t)p[3] << 24);
+	// sign extend from field width
+	int shift = field->is_signed ? 32 - (8 * field->width) : 0;
+	int32_t val = field->is_signed ? ((int32_t)(raw << shift) >> shift) : (int32_t)raw;
+	return (float)val * field->factor;
 }
 
-static void parse_motion_config(uint8_t *resp, size_t len) {
-	//print_resp(resp, len);
-	int node_id = resp[RESP_ID];
-	aSubRecord *step_interval_pv = get_pv(node_id, ID_STEP_INTERVAL);
-	aSubRecord *temp_comp_pv = get_pv(node_id, ID_TEMP_COMP_INTERVAL);
-	aSubRecord *mag_comp_pv = get_pv(node_id, ID_MAG_COMP_INTERVAL);
-	aSubRecord *frequency_pv = get_pv(node_id, ID_MOTION_FREQ);
-	aSubRecord *wake_pv = get_pv(node_id, ID_WAKE);
-	uint16_t val;
-	if (step_interval_pv != 0) {
-		val = (resp[3]) | (resp[4] << 8);
-		set_pv(step_interval_pv, val);
-	}
-	if (temp_comp_pv != 0) {
-		val = (resp[5]) | (resp[6] << 8);
-		set_pv(temp_comp_pv, val);
-	}
-	if (mag_comp_pv != 0) {
-		val = (resp[7]) | (resp[8] << 8);
-		set_pv(mag_comp_pv, val);
-	}
-	if (frequency_pv != 0) {
-		val = (resp[9]) | (resp[10] << 8);
-		set_pv(frequency_pv, val);
+/*
+ *	vector decoding of motion payloads
+ *	quaternion, raw motion and Euler fields are consecutive signed integers of one width,
+ *	so the payload is converted in SSE2 lanes with a scale per lane (a scalar loop without SSE2)
+ */
+
+// opcode whose fields are packed; width is 0 for opcodes decoded field by field
+typedef struct {
+	uint8_t offset;
+	uint8_t width;
+	uint8_t count;
+	float scales[MAX_FIELDS];
+} PackedDesc;
+
+static PackedDesc g_packed[NUM_OPCODES];
+
+// find opcodes whose fields can be decoded as one vector; called once before any response is parsed
+static void init_packed_decode() {
+	for (int op=0; op<NUM_OPCODES; op++) {
+		const OpcodeDesc *desc = &g_opcodes[op];
+		const FieldDesc *first = &desc->fields[0];
+		if (desc->num_fields < 2 || (first->width != 2 && first->width != 4))
+			continue;
+		int packed = 1;
+		for (int i=0; i<desc->num_fields; i++) {
+			const FieldDesc *field = &desc->fields[i];
+			if (field->width != first->width || !field->is_signed || field->pv_id == FIELD_ADD || field->offset != first->offset + i * first->width)
+				packed = 0;
+		}
+		if (!packed)
+			continue;
+		PackedDesc *pd = &g_packed[op];
+		pd->offset = first->offset;
+		pd->width = first->width;
+		pd->count = desc->num_fields;
+		for (int i=0; i<desc->num_fields; i++)
+			pd->scales[i] = desc->fields[i].factor;
 	}
-	if (wake_pv != 0)
-		set_pv(wake_pv, resp[11]);
 }
 
-static void parse_conn_param(uint8_t *resp, size_t len) {
-	//print_resp(resp, len);
-	int node_id = resp[RESP_ID];
-	aSubRecord *min_interval_pv = get_pv(node_id, ID_CONN_MIN_INTERVAL);
-	aSubRecord *max_interval_pv = get_pv(node_id, ID_CONN_MAX_INTERVAL);
-	aSubRecord *latency_pv = get_pv(node_id, ID_CONN_LATENCY);
-	aSubRecord *timeout_pv = get_pv(node_id, ID_CONN_TIMEOUT);
-	float x;
-	if (min_interval_pv != 0) {
-		x = (resp[3]) | (resp[4] << 8);
-		x *= 1.25;
-		set_pv(min_interval_pv, x);
-	}
-	if (max_interval_pv != 0) {
-		x = (resp[5]) | (resp[6] << 8);
-		x *= 1.25;
-		set_pv(max_interval_pv, x);
+// decode all fields of a packed opcode; same results as decode_field() on each
+// vectors are only loaded while they lie within the len bytes of the response, the rest are decoded one by one
+static void decode_packed(const uint8_t *resp, size_t len, const PackedDesc *pd, float *vals) {
+	const uint8_t *p = &resp[pd->offset];
+	size_t avail = len - pd->offset;
+	int i = 0;
+#ifdef __SSE2__
+	if (pd->width == 2) {
+		for (; i + 8 <= pd->count && (i + 8) * 2 <= avail; i += 8) {
+			__m128i raw = _mm_loadu_si128((const __m128i*)&p[i * 2]);
+			// each int16 duplicated into an int32 lane, then sign extended by an arithmetic shift
+			__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16);
+			__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(raw, raw), 16);
+			_mm_storeu_ps(&vals[i], _mm_mul_ps(_mm_cvtepi32_ps(lo), _mm_loadu_ps(&pd->scales[i])));
+			_mm_storeu_ps(&vals[i + 4], _mm_mul_ps(_mm_cvtepi32_ps(hi), _mm_loadu_ps(&pd->scales[i + 4])));
+		}
 	}
-	if (latency_pv != 0) {
-		x = (resp[7]) | (resp[8] << 8);
-		set_pv(latency_pv, x);
+	else {
+		for (; i + 4 <= pd->count && (i + 4) * 4 <= avail; i += 4) {
+			__m128i raw = _mm_loadu_si128((const __m128i*)&p[i * 4]);
+			_mm_storeu_ps(&vals[i], _mm_mul_ps(_mm_cvtepi32_ps(raw), _mm_loadu_ps(&pd->scales[i])));
+		}
 	}
-	if (timeout_pv != 0) {
-		x = (resp[9]) | (resp[10] << 8);
-		x *= 10;
-		set_pv(timeout_pv, x);
+#endif
+	for (; i<pd->count; i++) {
+		const uint8_t *q = &p[i * pd->width];
+		int32_t val;
+		if (pd->width == 2)
+			val = (int16_t)(q[0] | (q[1] << 8));
+		else
+			val = (int32_t)(q[0] | (q[1] << 8) | (q[2] << 16) | ((uint32_t)q[3] << 24));
+		vals[i] = (float)val * pd->scales[i];
 	}
 }
 
-static void parse_io(uint8_t *resp, size_t len) {
-	//print_resp(resp, len);
-	int node_id = resp[RESP_ID];
-	aSubRecord *ext0 = get_pv(node_id, ID_EXT0);
-	aSubRecord *ext1 = get_pv(node_id, ID_EXT1);
-	aSubRecord *ext2 = get_pv(node_id, ID_EXT2);
-	aSubRecord *ext3 = get_pv(node_id, ID_EXT3);
-	float x;
-	if (ext0 != 0) {
-		set_pv(ext0, resp[3]);
-	}
-	if (ext1 != 0) {
-		set_pv(ext1, resp[4]);
-	}
-	if (ext2 != 0) {
-		set_pv(ext2, resp[5]);
-	}
-	if (ext3 != 0) {
-		set_pv(ext3, resp[6]);
+// publish decoded sample of the given node/opcode through decimation, blocks and the change filter
+static void publish_sample(Aggregator *agg, int node_id, int opcode, float *vals, const int *pv_ids, int n, const epicsTimeStamp *stamp) {
+	// decimated samples are stamped with the receive time of the last sample of their window
+	if (decimate_sample(agg, node_id, opcode, vals, n))
+		return;
+	if (hold_block_sample(agg, node_id, opcode, vals, n, stamp))
+		return;
+	aSubRecord *pvs[MAX_FIELDS];
+	int count = 0;
+	for (int i=0; i<n; i++) {
+		pvs[count] = get_pv(agg, node_id, pv_ids[i]);
+		if (pvs[count] != 0 && value_changed(pvs[count], pv_ids[i], vals[i]))
+			vals[count++] = vals[i];
 	}
+	publish_pvs(agg, node_id, opcode, pvs, vals, count, stamp);
+}
+
+/*
+ *	Euler angles and heading derived from quaternions (thingyDeriveEuler)
+ *	saves the airtime of the device's Euler and heading streams
+ */
+
+// set to 1 in st.cmd to derive Euler angles and heading from quaternions
+int thingyDeriveEuler = 0;
+epicsExportAddress(int, thingyDeriveEuler);
+
+static const int g_euler_pv_ids[] = { ID_ROLL, ID_PITCH, ID_YAW };
+static const int g_heading_pv_ids[] = { ID_HEADING };
+
+// publish roll, pitch and yaw (Z-Y-X order, in degrees like the device's) and heading (yaw from 0 to 360 degrees)
+// of a quaternion, for the streams enabled with the node's Euler and heading toggles
+static void derive_euler(Aggregator *agg, int node_id, const float *quat, const epicsTimeStamp *stamp) {
+	if (node_id >= agg->max_nodes)
+		return;
+	int row = (g_custom_ids && g_ioc_started) ? agg->nodes[node_id].custom_id : node_id;
+	if (row < 0 || (!agg->nodes[row].derive_euler && !agg->nodes[row].derive_heading))
+		return;
+	float w = quat[0], x = quat[1], y = quat[2], z = quat[3];
+	float sinp = 2 * (w * y - z * x);
+	if (sinp > 1)
+		sinp = 1;
+	else if (sinp < -1)
+		sinp = -1;
+	float euler[3];
+	euler[0] = atan2f(2 * (w * x + y * z), 1 - 2 * (x * x + y * y)) * (180 / M_PI);
+	euler[1] = asinf(sinp) * (180 / M_PI);
+	euler[2] = atan2f(2 * (w * z + x * y), 1 - 2 * (y * y + z * z)) * (180 / M_PI);
+	float heading = (euler[2] < 0) ? euler[2] + 360 : euler[2];
+	if (agg->nodes[row].derive_euler)
+		publish_sample(agg, node_id, OPCODE_EULER, euler, g_euler_pv_ids, 3, stamp);
+	if (agg->nodes[row].derive_heading)
+		publish_sample(agg, node_id, OPCODE_HEADING, &heading, g_heading_pv_ids, 1, stamp);
 }
 
 // Parse response
-void parse_resp(uint8_t *resp, size_t len) {
+// returns 0 on success, 1 for a response too short for its opcode, 2 for an unknown opcode
+int parse_resp(Aggregator *agg, uint8_t *resp, size_t len, const epicsTimeStamp *stamp) {
 	//print_resp(resp, len);
+	if (len <= RESP_ID) {
+		stats_add(&agg->stats, -1, len > RESP_OPCODE ? resp[RESP_OPCODE] : -1, STAT_DECODE_ERRORS, 1);
+		printf("WARNING: Ignoring %d byte response\n", (int)len);
+		return 1;
+	}
 	uint8_t op = resp[RESP_OPCODE];
-	if (op == OPCODE_CONNECT)
-		parse_connect(resp, len);
-	else if (op == OPCODE_DISCONNECT)
-		parse_disconnect(resp, len);
-	else if (op == OPCODE_BUTTON)
-		parse_button(resp, len);
-	else if (op == OPCODE_BATTERY)
-		parse_battery(resp, len);
-	else if (op == OPCODE_RSSI)
-		parse_rssi(resp, len);
-	else if (op == OPCODE_TEMPERATURE)
-		parse_temperature(resp, len);
-	else if (op == OPCODE_PRESSURE)
-		parse_pressure(resp, len);
-	else if (op == OPCODE_HUMIDITY)
-		parse_humidity(resp, len);
-	else if (op == OPCODE_GAS)
-		parse_gas(resp, len);
-	else if (op == OPCODE_ENV_CONFIG)
-		parse_env_config(resp, len);
-	else if (op == OPCODE_QUATERNIONS)
-		parse_quaternions(resp, len);
-	else if (op == OPCODE_RAW_MOTION)
-		parse_raw_motion(resp, len);
-	else if (op == OPCODE_EULER)
-		parse_euler(resp, len);
-	else if (op == OPCODE_HEADING)
-		parse_heading(resp, len);
-	else if (op == OPCODE_MOTION_CONFIG)
-		parse_motion_config(resp, len);
-	else if (op == OPCODE_CONN_PARAM)
-		parse_conn_param(resp, len);
-	else if (op == OPCODE_EXTIO)
-		parse_io(resp, len);
-	else {
+	const OpcodeDesc *desc = (op < NUM_OPCODES) ? &g_opcodes[op] : 0;
+	if (desc == 0 || desc->min_len == 0) {
+		stats_add(&agg->stats, resp[RESP_ID], op, STAT_UNKNOWN_OPCODES, 1);
 		printf("unknown opcode: %d\n", op);
 		print_resp(resp, len);
+		return 2;
 	}
+	if (len < desc->min_len) {
+		stats_add(&agg->stats, resp[RESP_ID], op, STAT_DECODE_ERRORS, 1);
+		printf("WARNING: Ignoring opcode %d response of %d bytes; expected %d\n", op, (int)len, desc->min_len);
+		return 1;
+	}
+
+	epicsTimeStamp now;
+	if (stamp == 0) {
+		epicsTimeGetCurrent(&now);
+		stamp = &now;
+	}
+	int node_id = resp[RESP_ID];
+	if (thingyDeriveEuler && (op == OPCODE_EULER || op == OPCODE_HEADING)) {
+		// derived from quaternions instead; turn off the device's own stream, once per connection
+		int bit = (op == OPCODE_EULER) ? STREAM_OFF_EULER : STREAM_OFF_HEADING;
+		if (node_id < agg->max_nodes && !(atomic_fetch_or(&agg->nodes[node_id].streams_off, bit) & bit)) {
+			uint8_t command[4] = { COMMAND_SET_SENSOR, node_id, (op == OPCODE_EULER) ? ID_EULER_TOGGLE : ID_HEADING_TOGGLE, 0 };
+			send_command(agg, node_id, command, sizeof(command));
+		}
+		return 0;
+	}
+	float vals[MAX_FIELDS];
+	int pv_ids[MAX_FIELDS];
+	int n = 0;
+	const PackedDesc *pd = &g_packed[op];
+	if (pd->width != 0) {
+		decode_packed(resp, len, pd, vals);
+		for (n=0; n<pd->count; n++)
+			pv_ids[n] = desc->fields[n].pv_id;
+	}
+	else {
+		for (int i=0; i<desc->num_fields; i++) {
+			const FieldDesc *field = &desc->fields[i];
+			float x = decode_field(resp, field);
+			if (field->pv_id == FIELD_ADD) {
+				vals[n-1] += x;
+			}
+			else {
+				vals[n] = x;
+				pv_ids[n] = field->pv_id;
+				n++;
+			}
+		}
+	}
+	// cached before publish_sample() drops unchanged values from vals
+	config_cache_store(agg, node_id, op, vals, pv_ids, n, stamp);
+	// derived before the quaternion itself is decimated
+	if (thingyDeriveEuler && op == OPCODE_QUATERNIONS)
+		derive_euler(agg, node_id, vals, stamp);
+	publish_sample(agg, node_id, op, vals, pv_ids, n, stamp);
+
+	if (desc->handler != 0)
+		desc->handler(agg, resp, len, stamp);
+	return 0;
 }
 
 // print response
@@ -581,21 +815,19 @@ static void print_resp(uint8_t* resp, size_t len) {
 }
 
 // set status PV 
-int set_status(int node_id, char* status) {
+int set_status(Aggregator *agg, int node_id, char* status) {
 	//printf("status = %s for node %d\n", status, node_id);
-	aSubRecord *pv = get_pv(node_id, ID_STATUS);
+	aSubRecord *pv = get_pv(agg, node_id, ID_STATUS);
 	if (pv == 0)
 		return 1;
 	strncpy(pv->vala, status, 40);
-	if (g_ioc_started) {
-		scanOnce(pv);
-	}
+	scan_pv(pv, 0);
 	return 0;
 }
 
 // set gp_connection PV
-int set_connection(int node_id, int status) {
-	aSubRecord *pv = get_pv(node_id, ID_CONNECTION);
+int set_connection(Aggregator *agg, int node_id, int status) {
+	aSubRecord *pv = get_pv(agg, node_id, ID_CONNECTION);
 	if (pv == 0)
 		return 1;
 	//printf("set connection %d for node %d\n", status, node_id);
@@ -603,107 +835,193 @@ int set_connection(int node_id, int status) {
 	return 0;
 }
 
+// reset trigger PV of a command record
+// the record is processing, so OUTA writes the cleared value once the subroutine returns
+void clear_trigger(aSubRecord *pv) {
+	epicsInt16 zero = 0;
+	memcpy(pv->vala, &zero, sizeof(zero));
+}
+
 // Check if a read command PV was triggered, and send command if so
 long poll_command_pv(aSubRecord *pv, int opcode) {
 	int val;
 	memcpy(&val, pv->b, sizeof(int));
 	if (val != 0) {
+		Aggregator *agg = pv_aggregator(pv);
 		int node_id;
 		memcpy(&node_id, pv->a, sizeof(int));
-		#ifdef USE_CUSTOM_IDS
-			node_id = get_actual_node_id(node_id);
-		#endif
+		node_id = get_actual_node_id(agg, node_id);
+		if (node_id < 0 || config_cache_read(agg, node_id, opcode)) {
+			clear_trigger(pv);
+			return 0;
+		}
 
 		uint8_t command[2];
 		command[0] = opcode;
 		command[1] = node_id;
-		gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
-		set_pv(pv, 0);
+		send_command(agg, node_id, command, sizeof(command));
+		clear_trigger(pv);
 	}
 	return 0;
 }
 
 // send a read command (which has only 1 argument) to aggregator
-void send_read_command(int opcode, int node_id) {
-	#ifdef USE_CUSTOM_IDS
-		node_id = get_actual_node_id(node_id);
-	#endif
+void send_read_command(Aggregator *agg, int opcode, int node_id) {
+	node_id = get_actual_node_id(agg, node_id);
+	if (node_id < 0)
+		return;
 
 	uint8_t command[2];
 	command[0] = opcode;
 	command[1] = node_id;
-	gattlib_write_char_by_uuid(gp_connection, &g_send_uuid, command, sizeof(command));
+	send_command(agg, node_id, command, sizeof(command));
+}
+
+// add aggregator serving given number of nodes, allocating state of every node
+// done before any PV of it is registered
+int aggregator_create(const char *address, int max_nodes) {
+	if (g_num_aggregators == MAX_AGGREGATORS) {
+		printf("WARNING: Only %d aggregators are supported. Ignoring %s\n", MAX_AGGREGATORS, address);
+		return -1;
+	}
+	if (max_nodes < 1 || max_nodes > NODE_LIMIT) {
+		printf("Node count must be 1 to %d; using %d\n", NODE_LIMIT, MAX_NODES);
+		max_nodes = MAX_NODES;
+	}
+	Aggregator *agg = calloc(1, sizeof(Aggregator));
+	struct PublishState *ps = calloc(1, sizeof(struct PublishState));
+	if (agg == 0 || ps == 0) {
+		printf("Failed to allocate aggregator %s\n", address);
+		exit(1);
+	}
+	agg->nodes = calloc(max_nodes, sizeof(NodeState));
+	ps->lockers = calloc(max_nodes * NUM_OPCODES, sizeof(BatchLocker));
+	ps->blocks = calloc(max_nodes * NUM_OPCODES, sizeof(MotionBlock*));
+	ps->decimators = calloc(max_nodes * NUM_DECIMATED_STREAMS, sizeof(Decimator));
+	agg->max_nodes = max_nodes;
+	if (agg->nodes == 0 || ps->lockers == 0 || ps->blocks == 0 || ps->decimators == 0 || stats_init(&agg->stats, max_nodes) != 0 || node_ids_init(agg) != 0 || config_cache_init(agg) != 0) {
+		printf("Failed to allocate state for %d nodes\n", max_nodes);
+		exit(1);
+	}
+	snprintf(agg->address, sizeof(agg->address), "%s", address);
+	pthread_mutex_init(&agg->connlock, NULL);
+	pthread_mutex_init(&agg->statelock, NULL);
+	pthread_cond_init(&agg->statecond, NULL);
+	agg->conn_state = CONN_DISCONNECTED;
+	agg->publish = ps;
+	if (g_num_aggregators == 0)
+		init_packed_decode();
+	agg->id = g_num_aggregators;
+	gp_aggregators[agg->id] = agg;
+	g_num_aggregators++;
+	return agg->id;
+}
+
+Aggregator* get_aggregator(int agg_id) {
+	if (agg_id < 0 || agg_id >= g_num_aggregators)
+		return 0;
+	return gp_aggregators[agg_id];
 }
 
-// fetch PV from linked list given node/PV IDs
-aSubRecord* get_pv(int node_id, int pv_id) {
-	#ifdef USE_CUSTOM_IDS
-		if (g_ioc_started)
-			node_id = g_custom_node_ids[node_id];
-	#endif
+Aggregator* pv_aggregator(aSubRecord *pv) {
+	epicsInt16 agg_id;
+	memcpy(&agg_id, pv->u, sizeof(agg_id));
+	Aggregator *agg = get_aggregator(agg_id);
+	if (agg == 0)
+		printf("WARNING: No aggregator %d configured for %s\n", agg_id, pv->name);
+	return agg;
+}
 
-	PVnode *node = g_first_pv;
-	while (node != 0) {
-		if (node->node_id == node_id && node->pv_id == pv_id) {
-			return node->pv;
-		}
-		node = node->next;
+// fetch PV from table given node/PV IDs
+aSubRecord* get_pv(Aggregator *agg, int node_id, int pv_id) {
+	if (g_custom_ids && g_ioc_started && node_id >= 0 && node_id < agg->max_nodes)
+		node_id = agg->nodes[node_id].custom_id;
+
+	aSubRecord *pv = 0;
+	if (pv_id >= 0 && pv_id < NUM_PV_IDS) {
+		if (node_id == AGGREGATOR_ID)
+			pv = agg->pvs[pv_id];
+		else if (node_id >= 0 && node_id < agg->max_nodes)
+			pv = agg->nodes[node_id].pvs[pv_id];
 	}
-	printf("WARNING: No PV for node %d sensor %d\n", node_id, pv_id);
-	return 0;
+	if (pv == 0)
+		printf("WARNING: No PV for aggregator %d node %d sensor %d\n", agg->id, node_id, pv_id);
+	return pv;
 }
 
-// set PV value and scan it
+// stamp PV with the given time (current time if 0) and scan it
+// notifier records use TSE -2, so this is the timestamp their values are published with
+void scan_pv(aSubRecord *pv, const epicsTimeStamp *stamp) {
+	if (stamp != 0)
+		pv->time = *stamp;
+	else
+		epicsTimeGetCurrent(&pv->time);
+	if (g_ioc_started) {
+		scanOnce(pv);
+	}
+}
+
+// set PV value and scan it, unless unchanged
 int set_pv(aSubRecord *pv, float val) {
 	if (pv == 0)
 		return 1;
+	int pv_id;
+	memcpy(&pv_id, pv->b, sizeof(int));
+	if (!value_changed(pv, pv_id, val))
+		return 0;
 	memcpy(pv->vala, &val, sizeof(float));
-	if (g_ioc_started) {
-		scanOnce(pv);
-	}
+	scan_pv(pv, 0);
+	return 0;
+}
+
+// set array PV value and scan it
+// the PV must have FTVA DOUBLE; count is clipped to NOVA
+int set_pv_array(aSubRecord *pv, double *vals, int count) {
+	if (pv == 0)
+		return 1;
+	if (count > pv->nova)
+		count = pv->nova;
+	memcpy(pv->vala, vals, count * sizeof(double));
+	pv->neva = count;
+	scan_pv(pv, 0);
 	return 0;
 }
 
+// empty every array of a block PV (one per field, then sample times)
+static void clear_block_pv(aSubRecord *pv) {
+	epicsUInt32 *neva = &pv->neva;
+	for (int i=0; i<=MAX_FIELDS; i++)
+		neva[i] = 0;
+	scan_pv(pv, 0);
+}
+
 // mark dead nodes through PV values
-static void nullify_node_pvs(int node_id) {
-	#ifdef USE_CUSTOM_IDS
-		if (g_custom_node_ids[node_id] != -1)
-			node_id = g_custom_node_ids[node_id];
-	#endif
+static void nullify_node_pvs(Aggregator *agg, int node_id) {
+	if (g_custom_ids && agg->nodes[node_id].custom_id != -1)
+		node_id = agg->nodes[node_id].custom_id;
 
+	if (node_id < 0 || node_id >= agg->max_nodes)
+		return;
 	float null = 0;
-	int pv_id;
-	PVnode *node = g_first_pv;
-	aSubRecord *pv;
-	while (node != 0) {
-		pv_id = node->pv_id;
-		if (node->node_id == node_id && pv_id != ID_CONNECTION && pv_id != ID_STATUS) {
+	aSubRecord **row = agg->nodes[node_id].pvs;
+	for (int pv_id=0; pv_id<NUM_PV_IDS; pv_id++) {
+		if (row[pv_id] != 0 && pv_id != ID_CONNECTION && pv_id != ID_STATUS && pv_id != ID_LIVENESS_TIMEOUT && (pv_id < ID_QUATERNION_DECIMATION || pv_id > ID_EULER_DECIMATION)) {
 			if (pv_id == ID_BUTTON)
-				set_pv(node->pv, 0);
+				set_pv(row[pv_id], 0);
+			else if (pv_id >= ID_QUATERNION_BLOCK && pv_id <= ID_HEADING_BLOCK)
+				clear_block_pv(row[pv_id]);
 			else
-				set_pv(node->pv, null);
+				set_pv(row[pv_id], null);
 		}
-		node = node->next;
 	}
 }
 
-void disconnect_node(int node_id) {
-	nullify_node_pvs(node_id);
-	set_status(node_id, "DISCONNECTED");
-	set_connection(node_id, DISCONNECTED);
-	g_dead[node_id] = 1;
-	#ifdef USE_CUSTOM_IDS
-		g_custom_node_ids[node_id] = -1;
-	#endif
+void disconnect_node(Aggregator *agg, int node_id) {
+	if (node_id < 0 || node_id >= agg->max_nodes)
+		return;
+	nullify_node_pvs(agg, node_id);
+	config_cache_invalidate(agg, node_id, -1);
+	set_status(agg, node_id, "DISCONNECTED");
+	set_connection(agg, node_id, DISCONNECTED);
+	agg->nodes[node_id].dead = 1;
 }
-
-#ifdef USE_CUSTOM_IDS
-	int get_actual_node_id(int node_id) {
-		for (int i=0; i<MAX_NODES; i++)
-			if (g_custom_node_ids[i] == node_id) {
-				//printf("custom id %d -> actual id %d\n", node_id, i);
-				return i;
-			}
-		return -1;
-	}
-#endif
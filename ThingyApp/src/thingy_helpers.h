@@ -1,20 +1,31 @@
 // helper functions
 
-uuid_t aggregator_UUID(const char*);
+void disconnect_node(Aggregator*, int);
 
-void disconnect_node(int);
+// stamp is the receive time records are published with; 0 for current time
+int parse_resp(Aggregator*, uint8_t*, size_t, const epicsTimeStamp*);
 
-void parse_resp(uint8_t*, size_t);
+void scan_pv(aSubRecord*, const epicsTimeStamp*);
+int set_status(Aggregator*, int, char*);
+int set_connection(Aggregator*, int, int);
 
-int set_status(int, char*);
-int set_connection(int, int);
+// aggregator of record, given by its AggID (INPU); 0 if not configured
+Aggregator* pv_aggregator(aSubRecord*);
 
 long poll_command_pv(aSubRecord*, int);
-void send_read_command(int, int);
+void clear_trigger(aSubRecord*);
+void send_read_command(Aggregator*, int, int);
 
-void toggle_io_helper(int, int);
+float get_writer_pv_value(Aggregator*, int, int);
 
-void write_env_config_helper(int);
-void write_conn_param_helper(int);
+void toggle_io_helper(Aggregator*, int, int);
 
-int get_actual_node_id(int);
+// Euler angles and heading are derived from quaternions rather than streamed by nodes
+extern int thingyDeriveEuler;
+
+void write_env_config_helper(Aggregator*, int);
+void write_motion_config_helper(Aggregator*, int);
+void write_conn_param_helper(Aggregator*, int);
+
+// copy receive-to-publish latency histogram into array of LATENCY_BUCKETS and reset it
+void take_publish_latency(Aggregator*, double*);
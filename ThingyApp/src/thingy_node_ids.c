@@ -0,0 +1,203 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <iocsh.h>
+#include <epicsExport.h>
+
+#include "thingy_shared.h"
+#include "thingy_aggregator.h"
+#include "thingy_node_ids.h"
+
+// file assignments are persisted to; empty if not persisted
+static char g_id_file[256];
+// serializes rewrites of the ID file from parser threads of different aggregators
+static pthread_mutex_t g_id_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int node_ids_init(Aggregator *agg) {
+	agg->actual_ids = malloc(agg->max_nodes * sizeof(int));
+	if (agg->actual_ids == 0)
+		return 1;
+	for (int i=0; i<agg->max_nodes; i++) {
+		agg->nodes[i].custom_id = -1;
+		agg->actual_ids[i] = -1;
+	}
+	return 0;
+}
+
+int get_actual_node_id(Aggregator *agg, int node_id) {
+	if (!g_custom_ids || node_id == AGGREGATOR_ID)
+		return node_id;
+	if (node_id < 0 || node_id >= agg->max_nodes)
+		return -1;
+	return agg->actual_ids[node_id];
+}
+
+// rewrite ID file with current assignments of every aggregator
+// written to a temporary file first so a crash never leaves it truncated
+static void save_ids() {
+	if (g_id_file[0] == 0)
+		return;
+	char tmp[sizeof(g_id_file) + 4];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", g_id_file);
+	pthread_mutex_lock(&g_id_file_lock);
+	FILE *f = fopen(tmp, "w");
+	if (f == 0) {
+		printf("WARNING: Failed to write custom node IDs to %s\n", tmp);
+		pthread_mutex_unlock(&g_id_file_lock);
+		return;
+	}
+	fprintf(f, "# aggregator address, actual node ID, custom node ID, Bluetooth name\n");
+	for (int i=0; i<g_num_aggregators; i++) {
+		Aggregator *agg = gp_aggregators[i];
+		for (int node_id=0; node_id<agg->max_nodes; node_id++) {
+			NodeState *node = &agg->nodes[node_id];
+			if (node->custom_id != -1)
+				fprintf(f, "%s %d %d %s\n", agg->address, node_id, node->custom_id, node->name);
+		}
+	}
+	fclose(f);
+	if (rename(tmp, g_id_file) != 0)
+		printf("WARNING: Failed to replace %s\n", g_id_file);
+	pthread_mutex_unlock(&g_id_file_lock);
+}
+
+// drop assignment of actual node ID from both maps
+static void unassign(Aggregator *agg, int node_id) {
+	int custom_id = agg->nodes[node_id].custom_id;
+	if (custom_id == -1)
+		return;
+	agg->actual_ids[custom_id] = -1;
+	agg->nodes[node_id].custom_id = -1;
+	agg->nodes[node_id].name[0] = 0;
+}
+
+// map actual node ID to custom node ID in both directions
+static void assign(Aggregator *agg, int node_id, int custom_id, const char *name) {
+	unassign(agg, node_id);
+	agg->nodes[node_id].custom_id = custom_id;
+	agg->actual_ids[custom_id] = node_id;
+	snprintf(agg->nodes[node_id].name, sizeof(agg->nodes[node_id].name), "%s", name);
+}
+
+void node_ids_load(Aggregator *agg) {
+	if (!g_custom_ids || g_id_file[0] == 0)
+		return;
+	FILE *f = fopen(g_id_file, "r");
+	if (f == 0)
+		return;
+	char line[AGGREGATOR_ADDRESS_LEN + MAX_NAME_LENGTH + 32];
+	char address[AGGREGATOR_ADDRESS_LEN];
+	char name[MAX_NAME_LENGTH + 1];
+	int node_id, custom_id;
+	int count = 0;
+	while (fgets(line, sizeof(line), f) != 0) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%99s %d %d %15s", address, &node_id, &custom_id, name) != 4)
+			continue;
+		if (strcmp(address, agg->address) != 0)
+			continue;
+		if (node_id < 0 || node_id >= agg->max_nodes || custom_id < 0 || custom_id >= agg->max_nodes) {
+			printf("WARNING: Ignoring custom node ID %d of actual ID %d in %s: exceeds node count %d\n", custom_id, node_id, g_id_file, agg->max_nodes);
+			continue;
+		}
+		// a later line for the same custom ID replaces the earlier one
+		if (agg->actual_ids[custom_id] != -1)
+			unassign(agg, agg->actual_ids[custom_id]);
+		assign(agg, node_id, custom_id, name);
+		count++;
+	}
+	fclose(f);
+	if (count > 0)
+		printf("Restored %d custom node IDs of aggregator %d from %s\n", count, agg->id, g_id_file);
+}
+
+// custom ID given by name: N for CUSTOM_NODE_NAME followed by N, otherwise the actual node ID
+static int parse_custom_id(const char *name, int node_id) {
+	size_t prefix = strlen(CUSTOM_NODE_NAME);
+	if (strncmp(name, CUSTOM_NODE_NAME, prefix) != 0 || name[prefix] == 0)
+		return node_id;
+	char *end;
+	long custom_id = strtol(&name[prefix], &end, 10);
+	if (*end != 0 || custom_id < 0 || custom_id >= NODE_LIMIT)
+		return node_id;
+	return custom_id;
+}
+
+int node_id_connect(Aggregator *agg, int node_id, const uint8_t *resp, size_t len) {
+	// get Bluetooth name of node, padded with spaces
+	char name[MAX_NAME_LENGTH + 1];
+	int name_length = 0;
+	for (; name_length < MAX_NAME_LENGTH && RESP_CONNECT_NAME + name_length < len; name_length++) {
+		if (resp[RESP_CONNECT_NAME + name_length] == ' ')
+			break;
+		name[name_length] = resp[RESP_CONNECT_NAME + name_length];
+	}
+	name[name_length] = 0;
+
+	NodeState *node = &agg->nodes[node_id];
+	// same device as before (eg. restored from the ID file); nothing to learn
+	if (node->custom_id != -1 && strcmp(node->name, name) == 0)
+		return 0;
+	// a different device took this actual ID
+	unassign(agg, node_id);
+
+	int custom_id = parse_custom_id(name, node_id);
+	if (custom_id >= agg->max_nodes) {
+		printf("WARNING: Can not assign node ID %d to device %s: exceeds node count %d\n", custom_id, name, agg->max_nodes);
+		save_ids();
+		return 1;
+	}
+	int holder = agg->actual_ids[custom_id];
+	if (holder != -1) {
+		// the same device under a new actual ID takes its assignment along;
+		// otherwise the ID stays with the device that has it until that one is gone
+		if (strcmp(agg->nodes[holder].name, name) != 0 && !agg->nodes[holder].dead) {
+			printf("WARNING: Can not assign node ID %d to device %s: Already in use by %s\n", custom_id, name, agg->nodes[holder].name);
+			save_ids();
+			return 1;
+		}
+		unassign(agg, holder);
+	}
+	assign(agg, node_id, custom_id, name);
+	if (custom_id != node_id)
+		printf("Assigned custom node ID %d to device %s (actual ID %d)\n", custom_id, name, node_id);
+	else
+		printf("Assigned node ID %d to device %s\n", custom_id, name);
+	save_ids();
+	return 0;
+}
+
+void node_id_release(Aggregator *agg, int node_id) {
+	if (agg->nodes[node_id].custom_id == -1)
+		return;
+	unassign(agg, node_id);
+	save_ids();
+}
+
+/*
+ *	iocsh commands
+ */
+
+// enable custom node IDs, persisting assignments to file if one is given; must be called before iocInit
+static const iocshArg customIdsArg0 = {"file", iocshArgString};
+static const iocshArg * const customIdsArgs[] = {&customIdsArg0};
+static const iocshFuncDef customIdsDef = {"thingyCustomIds", 1, customIdsArgs};
+static void customIdsCallFunc(const iocshArgBuf *args) {
+	if (g_ioc_started) {
+		printf("thingyCustomIds must be called before iocInit\n");
+		return;
+	}
+	g_custom_ids = 1;
+	if (args[0].sval != 0)
+		snprintf(g_id_file, sizeof(g_id_file), "%s", args[0].sval);
+}
+
+static void thingyNodeIdsRegister(void) {
+	iocshRegister(&customIdsDef, customIdsCallFunc);
+}
+
+epicsExportRegistrar(thingyNodeIdsRegister);
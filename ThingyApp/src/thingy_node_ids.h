@@ -0,0 +1,27 @@
+#ifndef THINGY_NODE_IDS_H
+#define THINGY_NODE_IDS_H
+
+// custom node IDs, enabled with thingyCustomIds()
+// the aggregator's (actual) node IDs are mapped to custom node IDs taken from Bluetooth names
+// NodeState.custom_id maps actual to custom, Aggregator.actual_ids maps custom to actual
+
+struct Aggregator;
+
+// allocate ID maps of aggregator, all unassigned; returns nonzero on failure
+int node_ids_init(struct Aggregator*);
+
+// restore assignments of aggregator from the ID file, if any
+void node_ids_load(struct Aggregator*);
+
+// assign custom ID to node from the Bluetooth name in its connect response
+// returns 0 if the node has a custom ID
+int node_id_connect(struct Aggregator*, int, const uint8_t*, size_t);
+
+// release custom ID of node that left the aggregator
+void node_id_release(struct Aggregator*, int);
+
+// actual node ID of custom node ID, or -1 if not assigned
+// returns node ID unchanged if custom IDs are disabled
+int get_actual_node_id(struct Aggregator*, int);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef THINGY_PROTOCOL_H
+#define THINGY_PROTOCOL_H
+
+// Command and response framing spoken by the aggregator firmware
+
+// Opcodes for commands
+#define COMMAND_LED_TOGGLE 2
+#define COMMAND_ENV_CONFIG_READ 6
+#define COMMAND_ENV_CONFIG_WRITE 7
+#define COMMAND_MOTION_CONFIG_READ 8
+#define COMMAND_MOTION_CONFIG_WRITE 9 
+#define COMMAND_SET_SENSOR 10
+#define COMMAND_CONN_PARAM_READ 11
+#define COMMAND_CONN_PARAM_WRITE 12
+#define COMMAND_IO_READ 13
+#define COMMAND_IO_WRITE 14
+
+// Opcodes for responses
+#define OPCODE_CONNECT 1
+#define OPCODE_DISCONNECT 2
+#define OPCODE_BUTTON 3
+#define OPCODE_BATTERY 4
+#define OPCODE_RSSI 6
+#define OPCODE_TEMPERATURE 7
+#define OPCODE_PRESSURE 8
+#define OPCODE_HUMIDITY 9
+#define OPCODE_GAS 10
+#define OPCODE_ENV_CONFIG 11
+#define OPCODE_QUATERNIONS 12
+#define OPCODE_RAW_MOTION 13
+#define OPCODE_EULER 14
+#define OPCODE_HEADING 15
+#define OPCODE_MOTION_CONFIG 16
+#define OPCODE_CONN_PARAM 17
+#define OPCODE_EXTIO 18
+// highest response opcode + 1
+#define NUM_OPCODES 19
+
+// Indices for every response payload
+#define RESP_OPCODE 0
+#define RESP_ID 2
+
+// Indices for each response type
+#define RESP_CONNECT_NAME 11
+
+#define RESP_BUTTON_STATE 4
+
+#define RESP_BATTERY_LEVEL 3
+
+#define RESP_RSSI_VAL 3
+
+#define RESP_TEMPERATURE_INT 3
+#define RESP_TEMPERATURE_DEC 4
+
+#define RESP_PRESSURE_INT 3 // 4 byte int
+#define RESP_PRESSURE_DEC 7
+
+#define RESP_HUMIDITY_VAL 3
+
+#define RESP_GAS_CO2 3 // 2 byte uint
+#define RESP_GAS_TVOC 5 // 2 byte uint
+
+#define RESP_QUATERNIONS_W 3 // 4 byte int 2Q30 fixed point
+#define RESP_QUATERNIONS_X 7
+#define RESP_QUATERNIONS_Y 11
+#define RESP_QUATERNIONS_Z 15
+
+#define RESP_RAW_ACCEL_X 3 // 2 byte int 6Q10 fixed point
+#define RESP_RAW_ACCEL_Y 5
+#define RESP_RAW_ACCEL_Z 7
+#define RESP_RAW_GYRO_X 9 // 11Q5 fixed point
+#define RESP_RAW_GYRO_Y 11
+#define RESP_RAW_GYRO_Z 13
+#define RESP_RAW_COMPASS_X 15 // 12Q4 fixed point
+#define RESP_RAW_COMPASS_Y 17
+#define RESP_RAW_COMPASS_Z 19
+
+#define RESP_EULER_ROLL 3 // 4 byte int 16Q16 fixed point
+#define RESP_EULER_PITCH 7
+#define RESP_EULER_YAW 11
+
+#define RESP_HEADING_VAL 3 // 4 byte int 16Q16 fixed point
+
+#endif
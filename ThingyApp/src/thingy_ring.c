@@ -0,0 +1,79 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "thingy_ring.h"
+
+int ring_push(Ring *ring, const uint8_t *data, size_t len, const struct timespec *recv_time) {
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	unsigned depth = head - tail;
+	if (depth >= RING_SIZE || len > RING_SLOT_SIZE) {
+		atomic_fetch_add_explicit(&ring->overflows, 1, memory_order_relaxed);
+		return 1;
+	}
+
+	RingSlot *slot = &ring->slots[head & (RING_SIZE - 1)];
+	slot->recv_time = *recv_time;
+	slot->len = len;
+	memcpy(slot->data, data, len);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	depth++;
+	if (depth > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+		atomic_store_explicit(&ring->high_water, depth, memory_order_relaxed);
+	sem_post(&ring->ready);
+	return 0;
+}
+
+void ring_init(Ring *ring) {
+	sem_init(&ring->ready, 0, 0);
+}
+
+unsigned ring_wait(Ring *ring, int timeout_ms) {
+	if (ring_depth(ring) == 0) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while (sem_timedwait(&ring->ready, &deadline) != 0 && errno == EINTR)
+			;
+	}
+	// absorb posts for everything about to be drained
+	while (sem_trywait(&ring->ready) == 0)
+		;
+	return ring_depth(ring);
+}
+
+RingSlot* ring_peek(Ring *ring) {
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (head == tail)
+		return 0;
+	return &ring->slots[tail & (RING_SIZE - 1)];
+}
+
+void ring_pop(Ring *ring) {
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+unsigned ring_depth(Ring *ring) {
+	return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+unsigned ring_high_water(Ring *ring) {
+	return atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+}
+
+unsigned ring_overflows(Ring *ring) {
+	return atomic_load_explicit(&ring->overflows, memory_order_relaxed);
+}
@@ -0,0 +1,58 @@
+#ifndef THINGY_RING_H
+#define THINGY_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+// Single-producer/single-consumer ring between the notification callback
+// (producer) and the parser worker thread (consumer). One per aggregator.
+
+// number of slots in ring; must be a power of 2
+#define RING_SIZE 1024
+// max notification payload stored per slot
+#define RING_SLOT_SIZE 64
+// max notifications decoded per worker wakeup
+#define RING_BATCH 64
+
+typedef struct {
+	// CLOCK_REALTIME time the notification was received
+	struct timespec recv_time;
+	size_t len;
+	uint8_t data[RING_SLOT_SIZE];
+} RingSlot;
+
+typedef struct {
+	RingSlot slots[RING_SIZE];
+	// next slot to write; only advanced by producer
+	atomic_uint head;
+	// next slot to read; only advanced by consumer
+	atomic_uint tail;
+	// posted by producer after each push
+	sem_t ready;
+	atomic_uint high_water;
+	atomic_uint overflows;
+} Ring;
+
+// must be called before producer or consumer start
+void ring_init(Ring*);
+
+// producer side; stores payload with its CLOCK_REALTIME receive time
+// returns 0 on success, 1 if ring was full and payload was dropped
+int ring_push(Ring*, const uint8_t*, size_t, const struct timespec*);
+
+// consumer side
+// wait up to timeout_ms for notifications; returns number queued
+unsigned ring_wait(Ring*, int);
+// next queued slot, or 0 if empty; slot stays valid until ring_pop()
+RingSlot* ring_peek(Ring*);
+void ring_pop(Ring*);
+
+// statistics
+unsigned ring_depth(Ring*);
+unsigned ring_high_water(Ring*);
+unsigned ring_overflows(Ring*);
+
+#endif
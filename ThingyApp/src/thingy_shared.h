@@ -1,28 +1,31 @@
 // shared between all src files
 
+// default number of nodes, used when thingyConfig() is not given a node count
+// must match SERVER_COUNT in the Thingy firmware
 #define MAX_NODES 19
+// node IDs are one byte on the wire and 255 is reserved for the aggregator
+#define NODE_LIMIT 255
 
-// Pointer for mac address given by thingyConfig()
-char g_mac_address[100];
+// max aggregators served by one IOC, one per thingyConfig() call
+#define MAX_AGGREGATORS 8
 
 // Flag set when the IOC has started and PVs can be scanned
 int g_ioc_started;
+// Flag set by thingyCustomIds() to assign node IDs from Bluetooth names
+int g_custom_ids;
 
 // Bluetooth name to use when setting a custom node ID.
 // A device with a custom node ID N would have the name (CUSTOM_NODE_NAME + N)
 // eg. if CUSTOM_NODE_NAME = "Node" and N = 3, the device would have name "Node3"
 #define CUSTOM_NODE_NAME "Node"
-// comment out this line to disable custom node IDs
-//#define USE_CUSTOM_IDS
 
 
-#ifdef USE_CUSTOM_IDS
-	// array for mapping hardware node ID to custom node ID
-	int g_custom_node_ids[MAX_NODES];
-#endif
-
 #ifdef __cplusplus
 	extern "C" void disconnect();
+	extern "C" int aggregator_create(const char*, int);
 #else
 	void disconnect();
+	// add aggregator at given address serving given number of nodes
+	// returns its AggID, or -1 if MAX_AGGREGATORS are configured
+	int aggregator_create(const char*, int);
 #endif
\ No newline at end of file
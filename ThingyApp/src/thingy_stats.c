@@ -0,0 +1,70 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <dbAccess.h>
+#include <dbScan.h>
+#include <aSubRecord.h>
+
+#include "thingy_shared.h"
+#include "thingy_aggregator.h"
+#include "thingy_helpers.h"
+#include "thingy_stats.h"
+
+int stats_init(Stats *st, int max_nodes) {
+	st->node_stats = calloc(max_nodes * NUM_STATS, sizeof(atomic_ulong));
+	st->last_node_stats = calloc(max_nodes * NUM_STATS, sizeof(unsigned long));
+	st->node_rates = calloc(max_nodes, sizeof(double));
+	st->max_nodes = max_nodes;
+	return st->node_stats == 0 || st->last_node_stats == 0 || st->node_rates == 0;
+}
+
+void stats_add(Stats *st, int node_id, int opcode, int stat, unsigned long n) {
+	if (node_id >= 0 && node_id < st->max_nodes)
+		atomic_fetch_add_explicit(&st->node_stats[node_id * NUM_STATS + stat], n, memory_order_relaxed);
+	if (opcode < 0 || opcode >= STATS_OPCODES)
+		opcode = STATS_OPCODES - 1;
+	atomic_fetch_add_explicit(&st->opcode_stats[opcode][stat], n, memory_order_relaxed);
+}
+
+// rate of counter since last call, updating last value
+static double take_rate(atomic_ulong *counter, unsigned long *last, double seconds) {
+	unsigned long now = atomic_load_explicit(counter, memory_order_relaxed);
+	double rate = (now - *last) / seconds;
+	*last = now;
+	return rate;
+}
+
+// rate PV of each stat has total rate in VALA, per node rates in VALB and per opcode rates in VALC
+void stats_publish(Aggregator *agg, long elapsed_ms) {
+	if (elapsed_ms <= 0)
+		return;
+	Stats *st = &agg->stats;
+	double seconds = elapsed_ms / 1000.0;
+	double opcode_rates[STATS_OPCODES];
+	for (int stat=0; stat<NUM_STATS; stat++) {
+		// every event is counted once per opcode, so the opcode rows give the total
+		float total = 0;
+		for (int i=0; i<STATS_OPCODES; i++) {
+			opcode_rates[i] = take_rate(&st->opcode_stats[i][stat], &st->last_opcode_stats[i][stat], seconds);
+			total += opcode_rates[i];
+		}
+		for (int i=0; i<st->max_nodes; i++)
+			st->node_rates[i] = take_rate(&st->node_stats[i * NUM_STATS + stat], &st->last_node_stats[i * NUM_STATS + stat], seconds);
+
+		aSubRecord *pv = get_pv(agg, AGGREGATOR_ID, ID_PACKET_RATE + stat);
+		if (pv == 0)
+			continue;
+		int count = (st->max_nodes < pv->novb) ? st->max_nodes : pv->novb;
+		memcpy(pv->valb, st->node_rates, count * sizeof(double));
+		pv->nevb = count;
+		count = (STATS_OPCODES < pv->novc) ? STATS_OPCODES : pv->novc;
+		memcpy(pv->valc, opcode_rates, count * sizeof(double));
+		pv->nevc = count;
+		// always scanned, not through the change filter; the split can move while the total holds
+		memcpy(pv->vala, &total, sizeof(float));
+		scan_pv(pv, 0);
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef THINGY_STATS_H
+#define THINGY_STATS_H
+
+#include <stdatomic.h>
+#include "thingy_protocol.h"
+
+// Pipeline counters kept per node and per opcode.
+// Counters are only ever incremented with relaxed atomics, so they are cheap
+// enough for the notification path; rates are derived when published.
+
+#define STAT_PACKETS 0
+#define STAT_BYTES 1
+#define STAT_DECODE_ERRORS 2
+#define STAT_UNKNOWN_OPCODES 3
+// records published, batched or through scanOnce()
+#define STAT_PUBLISHES 4
+#define STAT_COMMANDS 5
+#define STAT_COMMAND_FAILURES 6
+#define NUM_STATS 7
+
+// rows of per-opcode counters; response opcodes and command opcodes share
+// rows since they are counted under different stats. Opcodes past the last
+// known opcode are counted in the last row.
+#define STATS_OPCODES (NUM_OPCODES + 1)
+
+// counters of one aggregator
+typedef struct {
+	int max_nodes;
+	// per-node counters indexed [node_id * NUM_STATS + stat], allocated by stats_init()
+	atomic_ulong *node_stats;
+	atomic_ulong opcode_stats[STATS_OPCODES][NUM_STATS];
+	// counter values at last publish, only used by the publishing thread
+	unsigned long *last_node_stats;
+	double *node_rates;
+	unsigned long last_opcode_stats[STATS_OPCODES][NUM_STATS];
+} Stats;
+
+struct Aggregator;
+
+// allocate per-node counters for given number of nodes; returns 0 on success
+int stats_init(Stats*, int);
+
+// add n to a counter of the given node and opcode
+void stats_add(Stats*, int, int, int, unsigned long);
+
+// publish rate of every counter of aggregator since last call; elapsed time in ms
+void stats_publish(struct Aggregator*, long);
+
+#endif
@@ -0,0 +1,14 @@
+#include <string.h>
+
+#include "thingy_transport.h"
+#include "thingy_capture.h"
+
+// pick backend based on address given to thingyConfig()
+ThingyTransport* transport_for_address(const char *address) {
+	if (strncmp(address, SOCKET_PREFIX_UNIX, strlen(SOCKET_PREFIX_UNIX)) == 0 ||
+		strncmp(address, SOCKET_PREFIX_TCP, strlen(SOCKET_PREFIX_TCP)) == 0)
+		return socket_transport_new();
+	if (strncmp(address, REPLAY_PREFIX, strlen(REPLAY_PREFIX)) == 0)
+		return replay_transport_new();
+	return gattlib_transport_new();
+}
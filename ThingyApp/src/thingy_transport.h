@@ -0,0 +1,65 @@
+#ifndef THINGY_TRANSPORT_H
+#define THINGY_TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Transport layer between the IOC and the aggregator.
+// Every backend carries the same opcode framing: a notification is the raw
+// response payload (RESP_OPCODE, RESP_ID, ...) and a command is the raw
+// command payload (COMMAND_*, node ID, ...).
+
+// called for every notification payload received from the aggregator
+// user is the pointer given to subscribe(); returns nonzero if the payload was dropped
+typedef int (*transport_notif_cb)(void*, const uint8_t*, size_t);
+// called when the connection to the aggregator is lost
+// user is the pointer given to on_disconnect()
+typedef void (*transport_disconnect_cb)(void*);
+
+// one instance per aggregator, created by transport_for_address()
+typedef struct ThingyTransport ThingyTransport;
+struct ThingyTransport {
+	const char *name;
+	// connect to aggregator at given address; returns 0 on success
+	int (*connect)(ThingyTransport*, const char*);
+	// close connection to aggregator
+	void (*disconnect)(ThingyTransport*);
+	// send command payload to aggregator; returns 0 on success
+	int (*write)(ThingyTransport*, const uint8_t*, size_t);
+	// register handler for lost connection; applies to every later connect
+	void (*on_disconnect)(ThingyTransport*, transport_disconnect_cb, void*);
+	// start notifications on current connection, delivered to callback
+	// must be called again after every connect
+	int (*subscribe)(ThingyTransport*, transport_notif_cb, void*);
+	// deliver notifications; blocks until stop()
+	void (*listen)(ThingyTransport*);
+	// stop delivering notifications
+	void (*stop)(ThingyTransport*);
+	// set if notifications are to wait for the parser instead of being dropped when it is behind
+	// (replay, which can deliver faster than the IOC decodes)
+	int lossless;
+	// backend state of this instance
+	void *state;
+};
+
+// Bluetooth backend (gattlib)
+ThingyTransport* gattlib_transport_new();
+
+// Socket backend for running against a fake aggregator process
+// address is "unix:<path>" or "tcp:<host>:<port>"
+ThingyTransport* socket_transport_new();
+
+// Replay of a notification capture; address is "replay:<file>"
+// see thingy_capture.h
+ThingyTransport* replay_transport_new();
+
+#define SOCKET_PREFIX_UNIX "unix:"
+#define SOCKET_PREFIX_TCP "tcp:"
+
+// Socket framing: each payload is preceded by a single length byte
+#define SOCKET_MAX_PAYLOAD 255
+
+// new transport instance for address; 0 if out of memory
+ThingyTransport* transport_for_address(const char*);
+
+#endif
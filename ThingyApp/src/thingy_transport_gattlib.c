@@ -0,0 +1,201 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <glib.h>
+#include "gattlib.h"
+
+#include "thingy_transport.h"
+
+// Bluetooth UUIDs for aggregator characteristics
+#define UUID_RECV "3e520003-1368-b682-4440-d7dd234c45bc"
+#define UUID_SEND "3e520002-1368-b682-4440-d7dd234c45bc"
+
+typedef struct {
+	// bluetooth UUID objects for communication with aggregator
+	uuid_t send_uuid;
+	uuid_t recv_uuid;
+	// connection object
+	gatt_connection_t *connection;
+	// lock for connection object, held while it is used or replaced
+	pthread_mutex_t gattlock;
+	int listening;
+	transport_notif_cb notif_cb;
+	void *notif_user;
+	transport_disconnect_cb disconnect_cb;
+	void *disconnect_user;
+} GattlibState;
+
+// main loop running notification callbacks of every aggregator
+// gattlib dispatches all connections on the default main context, so one loop
+// serves them all; it runs while any instance is listening
+static GMainLoop *gp_loop;
+static int g_listeners;
+static pthread_mutex_t g_looplock = PTHREAD_MUTEX_INITIALIZER;
+
+// taken from gattlib; convert string to 128 bit uint
+static uint128_t str_to_128t(const char *string) {
+	uint32_t data0, data4;
+	uint16_t data1, data2, data3, data5;
+	uint128_t u128;
+	uint8_t *val = (uint8_t *) &u128;
+
+	if(sscanf(string, "%08x-%04hx-%04hx-%04hx-%08x%04hx",
+				&data0, &data1, &data2,
+				&data3, &data4, &data5) != 6) {
+		printf("Parse of UUID %s failed\n", string);
+		memset(&u128, 0, sizeof(uint128_t));
+		return u128;
+	}
+
+	data0 = htonl(data0);
+	data1 = htons(data1);
+	data2 = htons(data2);
+	data3 = htons(data3);
+	data4 = htonl(data4);
+	data5 = htons(data5);
+
+	memcpy(&val[0], &data0, 4);
+	memcpy(&val[4], &data1, 2);
+	memcpy(&val[6], &data2, 2);
+	memcpy(&val[8], &data3, 2);
+	memcpy(&val[10], &data4, 4);
+	memcpy(&val[14], &data5, 2);
+
+	return u128;
+}
+
+// construct a 128 bit UUID object from string
+static uuid_t aggregator_UUID(const char *str) {
+	uint128_t uuid_val = str_to_128t(str);
+	uuid_t uuid = {.type=SDP_UUID128, .value.uuid128=uuid_val};
+	return uuid;
+}
+
+static void gattlib_disconnect_handler(void *user_data) {
+	GattlibState *st = user_data;
+	if (st->disconnect_cb != 0)
+		st->disconnect_cb(st->disconnect_user);
+}
+
+static void gattlib_notif_handler(const uuid_t *uuidObject, const uint8_t *resp, size_t len, void *user_data) {
+	GattlibState *st = user_data;
+	if (st->notif_cb != 0)
+		st->notif_cb(st->notif_user, resp, len);
+}
+
+static int gattlib_transport_connect(ThingyTransport *t, const char *address) {
+	GattlibState *st = t->state;
+	gatt_connection_t *connection = gattlib_connect(NULL, address, GATTLIB_CONNECTION_OPTIONS_LEGACY_BDADDR_LE_PUBLIC | GATTLIB_CONNECTION_OPTIONS_LEGACY_BT_SEC_LOW);
+	pthread_mutex_lock(&st->gattlock);
+	st->recv_uuid = aggregator_UUID(UUID_RECV);
+	st->send_uuid = aggregator_UUID(UUID_SEND);
+	st->connection = connection;
+	pthread_mutex_unlock(&st->gattlock);
+	if (connection == 0)
+		return 1;
+	gattlib_register_on_disconnect(connection, gattlib_disconnect_handler, st);
+	return 0;
+}
+
+static void gattlib_transport_disconnect(ThingyTransport *t) {
+	GattlibState *st = t->state;
+	pthread_mutex_lock(&st->gattlock);
+	if (st->connection != 0) {
+		gattlib_notification_stop(st->connection, &st->recv_uuid);
+		gattlib_disconnect(st->connection);
+		st->connection = 0;
+	}
+	pthread_mutex_unlock(&st->gattlock);
+}
+
+static int gattlib_transport_write(ThingyTransport *t, const uint8_t *data, size_t len) {
+	GattlibState *st = t->state;
+	int rc = 1;
+	pthread_mutex_lock(&st->gattlock);
+	if (st->connection != 0)
+		rc = gattlib_write_char_by_uuid(st->connection, &st->send_uuid, data, len);
+	pthread_mutex_unlock(&st->gattlock);
+	return rc;
+}
+
+static void gattlib_transport_on_disconnect(ThingyTransport *t, transport_disconnect_cb cb, void *user) {
+	GattlibState *st = t->state;
+	st->disconnect_cb = cb;
+	st->disconnect_user = user;
+}
+
+static int gattlib_transport_subscribe(ThingyTransport *t, transport_notif_cb cb, void *user) {
+	GattlibState *st = t->state;
+	int rc = 1;
+	st->notif_cb = cb;
+	st->notif_user = user;
+	pthread_mutex_lock(&st->gattlock);
+	if (st->connection != 0) {
+		gattlib_register_notification(st->connection, gattlib_notif_handler, st);
+		rc = gattlib_notification_start(st->connection, &st->recv_uuid);
+	}
+	pthread_mutex_unlock(&st->gattlock);
+	return rc;
+}
+
+// first listener runs the shared main loop, later ones wait on it
+static void gattlib_transport_listen(ThingyTransport *t) {
+	GattlibState *st = t->state;
+	pthread_mutex_lock(&g_looplock);
+	if (gp_loop == 0)
+		gp_loop = g_main_loop_new(NULL, 0);
+	GMainLoop *loop = g_main_loop_ref(gp_loop);
+	st->listening = 1;
+	int first = (g_listeners++ == 0);
+	pthread_mutex_unlock(&g_looplock);
+	// run forever waiting for notifications
+	if (first) {
+		g_main_loop_run(loop);
+	}
+	else {
+		while (st->listening && g_main_loop_is_running(loop))
+			usleep(100000);
+	}
+	g_main_loop_unref(loop);
+}
+
+// main loop is quit once the last listener stops
+static void gattlib_transport_stop(ThingyTransport *t) {
+	GattlibState *st = t->state;
+	pthread_mutex_lock(&g_looplock);
+	if (st->listening) {
+		st->listening = 0;
+		if (--g_listeners == 0 && gp_loop != 0)
+			g_main_loop_quit(gp_loop);
+	}
+	pthread_mutex_unlock(&g_looplock);
+}
+
+static const ThingyTransport g_gattlib_transport = {
+	.name = "gattlib",
+	.connect = gattlib_transport_connect,
+	.disconnect = gattlib_transport_disconnect,
+	.write = gattlib_transport_write,
+	.on_disconnect = gattlib_transport_on_disconnect,
+	.subscribe = gattlib_transport_subscribe,
+	.listen = gattlib_transport_listen,
+	.stop = gattlib_transport_stop,
+};
+
+ThingyTransport* gattlib_transport_new() {
+	ThingyTransport *t = malloc(sizeof(ThingyTransport));
+	GattlibState *st = calloc(1, sizeof(GattlibState));
+	if (t == 0 || st == 0) {
+		free(t);
+		free(st);
+		return 0;
+	}
+	*t = g_gattlib_transport;
+	pthread_mutex_init(&st->gattlock, NULL);
+	t->state = st;
+	return t;
+}
@@ -0,0 +1,146 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thingy_transport.h"
+#include "thingy_capture.h"
+
+typedef struct {
+	// capture file being replayed
+	FILE *file;
+	// flag to stop listen loop
+	int stop;
+	transport_notif_cb notif_cb;
+	void *notif_user;
+} ReplayState;
+
+static uint64_t timespec_ns(const struct timespec *ts) {
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static int replay_transport_connect(ThingyTransport *t, const char *address) {
+	ReplayState *st = t->state;
+	const char *path = address + strlen(REPLAY_PREFIX);
+	char magic[CAPTURE_MAGIC_LEN];
+	FILE *file = fopen(path, "rb");
+	if (file == 0) {
+		printf("Failed to open capture file %s\n", path);
+		return 1;
+	}
+	if (fread(magic, 1, CAPTURE_MAGIC_LEN, file) != CAPTURE_MAGIC_LEN || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+		printf("%s is not a capture file\n", path);
+		fclose(file);
+		return 1;
+	}
+	st->file = file;
+	return 0;
+}
+
+static void replay_transport_disconnect(ThingyTransport *t) {
+	ReplayState *st = t->state;
+	if (st->file != 0) {
+		fclose(st->file);
+		st->file = 0;
+	}
+}
+
+// commands have nowhere to go
+static int replay_transport_write(ThingyTransport *t, const uint8_t *data, size_t len) {
+	return 0;
+}
+
+// a replay never drops
+static void replay_transport_on_disconnect(ThingyTransport *t, transport_disconnect_cb cb, void *user) {
+}
+
+static int replay_transport_subscribe(ThingyTransport *t, transport_notif_cb cb, void *user) {
+	ReplayState *st = t->state;
+	st->notif_cb = cb;
+	st->notif_user = user;
+	return 0;
+}
+
+// deliver captured notifications, spaced by their capture times divided by replay speed
+static void replay_transport_listen(ThingyTransport *t) {
+	ReplayState *st = t->state;
+	uint8_t header[CAPTURE_RECORD_HEADER];
+	uint8_t payload[CAPTURE_MAX_PAYLOAD];
+	uint64_t first_capture = 0;
+	uint64_t last_capture = 0;
+	uint64_t count = 0;
+	uint64_t dropped = 0;
+	double speed = replay_speed();
+	struct timespec start, session_start, now;
+	st->stop = 0;
+	while (st->file == 0 && st->stop == 0)
+		usleep(100000);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (st->stop == 0) {
+		if (fread(header, 1, CAPTURE_RECORD_HEADER, st->file) != CAPTURE_RECORD_HEADER)
+			break;
+		size_t len = header[8];
+		if (fread(payload, 1, len, st->file) != len)
+			break;
+		uint64_t capture_time = 0;
+		for (int i=0; i<8; i++)
+			capture_time |= (uint64_t)header[i] << (8 * i);
+		// capture times are monotonic clock readings, so a time going backwards starts a session
+		// appended after a reboot; its records are timed from here
+		if (count == 0 || capture_time < last_capture) {
+			first_capture = capture_time;
+			clock_gettime(CLOCK_MONOTONIC, &session_start);
+		}
+		last_capture = capture_time;
+
+		if (speed > 0) {
+			uint64_t due = timespec_ns(&session_start) + (uint64_t)((capture_time - first_capture) / speed);
+			struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+		if (st->notif_cb != 0 && st->notif_cb(st->notif_user, payload, len) != 0)
+			dropped++;
+		count++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (timespec_ns(&now) - timespec_ns(&start)) / 1e9;
+	printf("Replay finished: %llu notifications in %.3f s (%.0f/s), %llu dropped by the ring\n", (unsigned long long)count, elapsed,
+		elapsed > 0 ? count / elapsed : 0, (unsigned long long)dropped);
+	// keep running like a connected transport with nothing left to say
+	while (st->stop == 0)
+		usleep(100000);
+}
+
+static void replay_transport_stop(ThingyTransport *t) {
+	ReplayState *st = t->state;
+	st->stop = 1;
+}
+
+static const ThingyTransport g_replay_transport = {
+	.name = "replay",
+	.connect = replay_transport_connect,
+	.disconnect = replay_transport_disconnect,
+	.write = replay_transport_write,
+	.on_disconnect = replay_transport_on_disconnect,
+	.subscribe = replay_transport_subscribe,
+	.listen = replay_transport_listen,
+	.stop = replay_transport_stop,
+	.lossless = 1,
+};
+
+ThingyTransport* replay_transport_new() {
+	ThingyTransport *t = malloc(sizeof(ThingyTransport));
+	ReplayState *st = calloc(1, sizeof(ReplayState));
+	if (t == 0 || st == 0) {
+		free(t);
+		free(st);
+		return 0;
+	}
+	*t = g_replay_transport;
+	t->state = st;
+	return t;
+}
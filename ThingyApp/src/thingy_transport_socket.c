@@ -0,0 +1,225 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "thingy_transport.h"
+
+typedef struct {
+	// socket file descriptor; -1 when not connected
+	int fd;
+	// lock for writes to socket
+	pthread_mutex_t writelock;
+	// flag to stop listen loop
+	int stop;
+	transport_notif_cb notif_cb;
+	void *notif_user;
+	transport_disconnect_cb disconnect_cb;
+	void *disconnect_user;
+} SocketState;
+
+static int connect_unix(const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int connect_tcp(const char *host_port) {
+	char host[100];
+	const char *sep = strrchr(host_port, ':');
+	if (sep == 0 || sep - host_port >= sizeof(host)) {
+		printf("Invalid TCP address %s; expected tcp:<host>:<port>\n", host_port);
+		return -1;
+	}
+	memset(host, 0, sizeof(host));
+	memcpy(host, host_port, sep - host_port);
+
+	struct addrinfo hints, *res, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, sep + 1, &hints, &res) != 0)
+		return -1;
+	int fd = -1;
+	for (ai = res; ai != 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+// read exactly len bytes; returns 0 on success
+static int read_full(int fd, uint8_t *buf, size_t len) {
+	size_t got = 0;
+	while (got < len) {
+		ssize_t n = read(fd, buf + got, len - got);
+		if (n == 0)
+			return 1;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+// write exactly len bytes; returns 0 on success
+static int write_full(int fd, const uint8_t *buf, size_t len) {
+	size_t sent = 0;
+	while (sent < len) {
+		ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		sent += n;
+	}
+	return 0;
+}
+
+// close socket and notify disconnect handler
+static void connection_lost(SocketState *st, int fd) {
+	pthread_mutex_lock(&st->writelock);
+	if (st->fd == fd) {
+		close(fd);
+		st->fd = -1;
+	}
+	pthread_mutex_unlock(&st->writelock);
+	if (st->disconnect_cb != 0)
+		st->disconnect_cb(st->disconnect_user);
+}
+
+static int socket_transport_connect(ThingyTransport *t, const char *address) {
+	SocketState *st = t->state;
+	int fd;
+	if (strncmp(address, SOCKET_PREFIX_UNIX, strlen(SOCKET_PREFIX_UNIX)) == 0)
+		fd = connect_unix(address + strlen(SOCKET_PREFIX_UNIX));
+	else if (strncmp(address, SOCKET_PREFIX_TCP, strlen(SOCKET_PREFIX_TCP)) == 0)
+		fd = connect_tcp(address + strlen(SOCKET_PREFIX_TCP));
+	else
+		fd = -1;
+	if (fd < 0)
+		return 1;
+	pthread_mutex_lock(&st->writelock);
+	st->fd = fd;
+	pthread_mutex_unlock(&st->writelock);
+	return 0;
+}
+
+static void socket_transport_disconnect(ThingyTransport *t) {
+	SocketState *st = t->state;
+	pthread_mutex_lock(&st->writelock);
+	if (st->fd >= 0) {
+		shutdown(st->fd, SHUT_RDWR);
+		close(st->fd);
+		st->fd = -1;
+	}
+	pthread_mutex_unlock(&st->writelock);
+}
+
+static int socket_transport_write(ThingyTransport *t, const uint8_t *data, size_t len) {
+	SocketState *st = t->state;
+	if (len > SOCKET_MAX_PAYLOAD)
+		return 1;
+	uint8_t frame[SOCKET_MAX_PAYLOAD + 1];
+	frame[0] = len;
+	memcpy(&frame[1], data, len);
+	int rc = 1;
+	pthread_mutex_lock(&st->writelock);
+	if (st->fd >= 0)
+		rc = write_full(st->fd, frame, len + 1);
+	pthread_mutex_unlock(&st->writelock);
+	return rc;
+}
+
+static void socket_transport_on_disconnect(ThingyTransport *t, transport_disconnect_cb cb, void *user) {
+	SocketState *st = t->state;
+	st->disconnect_cb = cb;
+	st->disconnect_user = user;
+}
+
+// frames are read from whichever socket is current, so only the callback is needed
+static int socket_transport_subscribe(ThingyTransport *t, transport_notif_cb cb, void *user) {
+	SocketState *st = t->state;
+	st->notif_cb = cb;
+	st->notif_user = user;
+	return 0;
+}
+
+// read length-prefixed frames until stopped
+// keeps running across reconnects, picking up the new socket once connected
+static void socket_transport_listen(ThingyTransport *t) {
+	SocketState *st = t->state;
+	uint8_t buf[SOCKET_MAX_PAYLOAD];
+	uint8_t len;
+	st->stop = 0;
+	while (st->stop == 0) {
+		int fd = st->fd;
+		if (fd < 0) {
+			usleep(100000);
+			continue;
+		}
+		if (read_full(fd, &len, 1) != 0 || read_full(fd, buf, len) != 0) {
+			if (st->stop == 0)
+				connection_lost(st, fd);
+			continue;
+		}
+		if (len > 0 && st->notif_cb != 0)
+			st->notif_cb(st->notif_user, buf, len);
+	}
+}
+
+static void socket_transport_stop(ThingyTransport *t) {
+	SocketState *st = t->state;
+	st->stop = 1;
+}
+
+static const ThingyTransport g_socket_transport = {
+	.name = "socket",
+	.connect = socket_transport_connect,
+	.disconnect = socket_transport_disconnect,
+	.write = socket_transport_write,
+	.on_disconnect = socket_transport_on_disconnect,
+	.subscribe = socket_transport_subscribe,
+	.listen = socket_transport_listen,
+	.stop = socket_transport_stop,
+};
+
+ThingyTransport* socket_transport_new() {
+	ThingyTransport *t = malloc(sizeof(ThingyTransport));
+	SocketState *st = calloc(1, sizeof(SocketState));
+	if (t == 0 || st == 0) {
+		free(t);
+		free(st);
+		return 0;
+	}
+	*t = g_socket_transport;
+	st->fd = -1;
+	pthread_mutex_init(&st->writelock, NULL);
+	t->state = st;
+	return t;
+}
@@ -9,3 +9,8 @@ echo
 echo Building thingy_name_assign...
 gcc ThingyApp/src/thingy_name_assign.c -lgattlib -o thingy_name_assign
 echo Done.
+
+echo
+echo Building thingy_fake_aggregator...
+gcc ThingyApp/src/thingy_fake_aggregator.c -lpthread -lm -o thingy_fake_aggregator
+echo Done.